@@ -1,6 +1,7 @@
 /* Embed Forth Virtual Machine, Richard James Howe, 2017-2018, MIT License */
 #include "embed.h"
 #include <assert.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -9,6 +10,16 @@
 #define SHADOW    (7)     /**< start location of shadow registers */
 #define MIN(X, Y) ((X) > (Y) ? (Y) : (X))
 
+#ifndef EMBED_STATS
+#define EMBED_STATS (1) /**< set to zero to compile out the counters kept in 'embed_stats_t' */
+#endif
+
+#if EMBED_STATS
+#define embed_count(STATS, COUNTER) do { if (STATS) (STATS)->count[(COUNTER)]++; } while (0)
+#else
+#define embed_count(STATS, COUNTER) do { (void)(STATS); } while (0)
+#endif
+
 typedef cell_t        m_t; /**< The VM is 16-bit, 'uintptr_t' would be more useful */
 typedef signed_cell_t s_t; /**< used for signed calculation and casting */
 typedef double_cell_t d_t; /**< should be double the size of 'm_t' and unsigned */
@@ -30,13 +41,207 @@ void embed_opt_set(embed_t *h, embed_opt_t *opt)   { assert(h && opt); memcpy(&h
 int embed_yield_cb(void *param)                    { (void)(param); return 0; }
 size_t embed_length(embed_t const * const h)       { return embed_cells(h) * sizeof(m_t); }
 
+/* Compressed images consist of a magic number, the uncompressed length in
+ * bytes (32-bit little endian) and a series of LZ77 sequences. Each sequence
+ * is a token byte, the high nibble being a literal count and the low nibble
+ * a match length less four, a value of fifteen in either is extended with
+ * bytes that are added to it until a byte that is not 255 is met. The
+ * literals follow, then a little endian 16-bit offset back into the already
+ * decompressed data for the match, the last sequence only contains literals.
+ * As the core itself is the window images can be decompressed in a single
+ * pass as the data is read in. */
+static const uint8_t embed_lz_magic[4] = { 0x89, 'E', 'Z', 0x1A };
+
+/* Sparse images consist of a magic number, the image length in bytes (32-bit
+ * little endian) and a list of extents of non-zero data. An extent is a 16-bit
+ * little endian starting cell and count of cells followed by those cells, the
+ * list is terminated by an extent with a count of zero. Anything not covered
+ * by an extent is zero. */
+static const uint8_t embed_sparse_magic[4] = { 0x89, 'E', 'S', 0x1A };
+
+typedef struct { const uint8_t *b; size_t length, i; } embed_buffer_t;
+
+static int embed_bgetc_cb(void *buffer, int *no_data) {
+	assert(buffer && no_data);
+	embed_buffer_t *b = buffer;
+	*no_data = 0;
+	return b->i < b->length ? b->b[b->i++] : -1;
+}
+
+static long embed_lz_extend(embed_fgetc_t get, void *in, long l) {
+	int no_data = 0;
+	if (l != 15)
+		return l;
+	for (int c; (c = get(in, &no_data)) >= 0; l += c)
+		if (c != 255)
+			return l + c;
+	return -1;
+}
+
+static int embed_lz_decompress(embed_t *h, embed_fgetc_t get, void *in) {
+	uint8_t *m = (uint8_t*)h->m;
+	d_t length = 0, o = 0;
+	int no_data = 0, c = 0;
+	for (int i = 0; i < 4; i++) {
+		if ((c = get(in, &no_data)) < 0)
+			return -70; /* read-file IOR */
+		length |= (d_t)c << (i * 8);
+	}
+	if (length > EMBED_CORE_SIZE * sizeof(m_t))
+		return -70;
+	while (o < length) {
+		const int token = get(in, &no_data);
+		long literals = token < 0 ? -1 : embed_lz_extend(get, in, token >> 4), match = 0;
+		if (literals < 0 || (o + literals) > length)
+			return -70;
+		for (; literals; literals--, m[o++] = c)
+			if ((c = get(in, &no_data)) < 0)
+				return -70;
+		if (o == length)
+			break;
+		const int lo = get(in, &no_data), hi = get(in, &no_data);
+		const d_t offset = lo | ((d_t)hi << 8);
+		match = embed_lz_extend(get, in, token & 15);
+		if (lo < 0 || hi < 0 || match < 0 || !offset || offset > o || (o + match + 4) > length)
+			return -70;
+		for (match += 4; match; match--, o++)
+			m[o] = m[o - offset];
+	}
+	embed_normalize(h, length/2);
+	return length < 128 ? -70 /* read-file IOR */ : 0; /* minimum size checks, 128 bytes */
+}
+
+static long embed_get16(embed_fgetc_t get, void *in) {
+	int no_data = 0;
+	const int lo = get(in, &no_data), hi = get(in, &no_data);
+	return lo < 0 || hi < 0 ? -1 : lo | ((long)hi << 8);
+}
+
+static int embed_sparse_load(embed_t *h, embed_fgetc_t get, void *in) {
+	uint8_t *m = (uint8_t*)h->m;
+	const long lo = embed_get16(get, in), hi = embed_get16(get, in);
+	const d_t length = lo | ((d_t)hi << 16);
+	if (lo < 0 || hi < 0 || length > EMBED_CORE_SIZE * sizeof(m_t))
+		return -70; /* read-file IOR */
+	memset(m, 0, length);
+	for (;;) {
+		const long start = embed_get16(get, in), count = embed_get16(get, in);
+		if (start < 0 || count < 0 || ((start + count) * sizeof(m_t)) > length)
+			return -70;
+		if (!count)
+			break;
+		for (long i = start * 2; i < (start + count) * 2; i++) {
+			int no_data = 0;
+			const int c = get(in, &no_data);
+			if (c < 0)
+				return -70;
+			m[i] = c;
+		}
+	}
+	embed_normalize(h, length/2);
+	return length < 128 ? -70 /* read-file IOR */ : 0; /* minimum size checks, 128 bytes */
+}
+
+int embed_load_stream(embed_t *h, embed_fgetc_t get, void *in) {
+	assert(h && get);
+	uint8_t *m = (uint8_t*)h->m;
+	size_t r = 0;
+	int no_data = 0;
+	for (int c; r < EMBED_CORE_SIZE * sizeof(m_t) && (c = get(in, &no_data)) >= 0; ) {
+		m[r++] = c;
+		if (r == sizeof embed_lz_magic && !memcmp(m, embed_lz_magic, sizeof embed_lz_magic))
+			return embed_lz_decompress(h, get, in);
+		if (r == sizeof embed_sparse_magic && !memcmp(m, embed_sparse_magic, sizeof embed_sparse_magic))
+			return embed_sparse_load(h, get, in);
+	}
+	embed_normalize(h, r/2);
+	return r < 128 ? -70 /* read-file IOR */ : 0; /* minimum size checks, 128 bytes */
+}
+
 int embed_load_buffer(embed_t *h, const uint8_t *buf, size_t length) {
 	assert(h && buf);
+	if (length >= sizeof embed_lz_magic && !memcmp(buf, embed_lz_magic, sizeof embed_lz_magic)) {
+		embed_buffer_t b = { .b = buf, .length = length, .i = sizeof embed_lz_magic };
+		return embed_lz_decompress(h, embed_bgetc_cb, &b);
+	}
+	if (length >= sizeof embed_sparse_magic && !memcmp(buf, embed_sparse_magic, sizeof embed_sparse_magic)) {
+		embed_buffer_t b = { .b = buf, .length = length, .i = sizeof embed_sparse_magic };
+		return embed_sparse_load(h, embed_bgetc_cb, &b);
+	}
 	memcpy(h->m, buf, MIN(EMBED_CORE_SIZE*2, length));
 	embed_normalize(h, length/2);
 	return length < 128 ? -70 /* read-file IOR */ : 0; /* minimum size checks, 128 bytes */
 }
 
+static int embed_lz_put(uint8_t *out, size_t *o, size_t length, const uint8_t *b, size_t l) {
+	if ((*o + l) > length)
+		return -1;
+	memcpy(out + *o, b, l);
+	*o += l;
+	return 0;
+}
+
+static int embed_lz_put_extend(uint8_t *out, size_t *o, size_t length, size_t l) {
+	const uint8_t ff = 255;
+	if (l < 15)
+		return 0;
+	for (l -= 15; l >= 255; l -= 255)
+		if (embed_lz_put(out, o, length, &ff, 1) < 0)
+			return -1;
+	const uint8_t b = l;
+	return embed_lz_put(out, o, length, &b, 1);
+}
+
+static int embed_lz_sequence(uint8_t *out, size_t *o, size_t length, const uint8_t *literals, size_t nliterals, size_t offset, size_t match) {
+	const uint8_t token = (MIN(nliterals, 15) << 4) | (match ? MIN(match - 4, 15) : 0);
+	const uint8_t off[2] = { offset & 255, offset >> 8 };
+	if (embed_lz_put(out, o, length, &token, 1) < 0)
+		return -1;
+	if (embed_lz_put_extend(out, o, length, nliterals) < 0)
+		return -1;
+	if (embed_lz_put(out, o, length, literals, nliterals) < 0)
+		return -1;
+	if (!match)
+		return 0;
+	if (embed_lz_put(out, o, length, off, sizeof off) < 0)
+		return -1;
+	return embed_lz_put_extend(out, o, length, match - 4);
+}
+
+int embed_compress(uint8_t *out, size_t *out_length, const uint8_t *in, size_t in_length) {
+	assert(out && out_length && in);
+	uint16_t table[4096] = { 0 }; /* hash of four bytes to last position seen */
+	const uint8_t length[4] = { in_length & 255, (in_length >> 8) & 255, (in_length >> 16) & 255, (in_length >> 24) & 255 };
+	size_t o = 0, anchor = 0, i = 0;
+	if (in_length > EMBED_CORE_SIZE * sizeof(m_t))
+		return -1;
+	if (embed_lz_put(out, &o, *out_length, embed_lz_magic, sizeof embed_lz_magic) < 0)
+		return -1;
+	if (embed_lz_put(out, &o, *out_length, length, sizeof length) < 0)
+		return -1;
+	while ((i + 4) <= in_length) {
+		const d_t v = in[i] | ((d_t)in[i + 1] << 8) | ((d_t)in[i + 2] << 16) | ((d_t)in[i + 3] << 24);
+		const size_t hash = ((v * 2654435761uL) & 0xFFFFFFFFuL) >> 20;
+		const size_t candidate = table[hash];
+		table[hash] = i;
+		if (candidate >= i || memcmp(in + candidate, in + i, 4)) {
+			i++;
+			continue;
+		}
+		size_t match = 4;
+		while ((i + match) < in_length && in[candidate + match] == in[i + match])
+			match++;
+		if (embed_lz_sequence(out, &o, *out_length, in + anchor, i - anchor, i - candidate, match) < 0)
+			return -1;
+		i += match;
+		anchor = i;
+	}
+	if (anchor < in_length && embed_lz_sequence(out, &o, *out_length, in + anchor, in_length - anchor, 0, 0) < 0)
+		return -1;
+	*out_length = o;
+	return 0;
+}
+
 int embed_default(embed_t *h) {
 	assert(h && h->m);
 	h->o = embed_opt_default();
@@ -47,10 +252,10 @@ int embed_sgetc_cb(void *string_ptr, int *no_data) {
 	assert(string_ptr && no_data);
 	char **sp = (char**)string_ptr;
 	const char ch = **sp;
+	*no_data = 0;
 	if (!ch)
 		return -1;
 	(*sp)++;
-	*no_data = 0;
 	return ch;
 }
 
@@ -75,6 +280,405 @@ int embed_eval(embed_t *h, const char *str) {
 	return r;
 }
 
+/* Patches consist of a magic number, a header of 16-bit little endian values
+ * (block size in cells, target image length in cells, the length and CRC
+ * stored in the eForth header of the source image and the CRC stored in the
+ * target), then a list of records each of which is a block number, the CRC of
+ * the block data and the block data itself, in block order. The list is
+ * terminated by block number $FFFF. An eForth image zeros the CRC in its
+ * header once it has checked it when it boots, which is how a live image is
+ * told apart from one that has just been loaded. Patching never writes that
+ * cell in a live image, so the zero stays as the mark of a live image. */
+static const uint8_t embed_patch_magic[4] = { 0x89, 'E', 'D', 0x1A };
+#define EMBED_PATCH_BLOCK  (64u)   /**< patch block size in cells */
+#define EMBED_HEADER_LEN   (0x0Fu) /**< cell containing length in eForth image header */
+#define EMBED_HEADER_CRC   (0x10u) /**< cell containing CRC in eForth image header */
+#define EMBED_PATCH_HEADER (14u)   /**< bytes before first patch record */
+
+static m_t embed_crc(m_t crc, const uint8_t *b, size_t l) { /* CCITT, as used by eForth */
+	for (size_t i = 0; i < l; i++) {
+		m_t x = (crc >> 8) ^ b[i];
+		x ^= x >> 4;
+		crc = (crc << 8) ^ (x << 12) ^ (x << 5) ^ x;
+	}
+	return crc;
+}
+
+static inline m_t embed_patch_get(const uint8_t *b) { return b[0] | (b[1] << 8); }
+static inline void embed_patch_put(uint8_t *b, m_t v) { b[0] = v & 255; b[1] = v >> 8; }
+
+int embed_diff(embed_t const * const from, embed_t const * const to, uint8_t *out, size_t *out_length) {
+	assert(from && to && out && out_length);
+	const embed_mmu_read_t ro = from->o.read, rn = to->o.read;
+	const size_t lo = embed_cells(from), ln = embed_cells(to);
+	size_t o = EMBED_PATCH_HEADER;
+	if (ln <= EMBED_HEADER_CRC || lo <= EMBED_HEADER_CRC || *out_length < o)
+		return -1;
+	memcpy(out, embed_patch_magic, sizeof embed_patch_magic);
+	embed_patch_put(out + 4,  EMBED_PATCH_BLOCK);
+	embed_patch_put(out + 6,  ln);
+	embed_patch_put(out + 8,  ro(from, EMBED_HEADER_LEN));
+	embed_patch_put(out + 10, ro(from, EMBED_HEADER_CRC));
+	embed_patch_put(out + 12, rn(to, EMBED_HEADER_CRC));
+	for (size_t b = 0; (b * EMBED_PATCH_BLOCK) < ln; b++) {
+		const size_t start = b * EMBED_PATCH_BLOCK, end = MIN(start + EMBED_PATCH_BLOCK, ln);
+		size_t i = start;
+		for (; i < end && i < lo && ro(from, i) == rn(to, i); i++)
+			;
+		if (i == end)
+			continue;
+		if ((o + 4 + (end - start) * 2) > *out_length)
+			return -1;
+		embed_patch_put(out + o, b);
+		for (i = start; i < end; i++)
+			embed_patch_put(out + o + 4 + (i - start) * 2, rn(to, i));
+		embed_patch_put(out + o + 2, embed_crc(0xFFFF, out + o + 4, (end - start) * 2));
+		o += 4 + (end - start) * 2;
+	}
+	if ((o + 2) > *out_length)
+		return -1;
+	embed_patch_put(out + o, 0xFFFF);
+	*out_length = o + 2;
+	return 0;
+}
+
+/* Value of cell 'i' as it will be once a checked patch has been applied, 'o'
+ * is the record to start looking from. Records are in block order, so for
+ * cells looked at in order 'o' only ever moves forward. */
+static m_t embed_patched(embed_t const * const h, const uint8_t *patch, size_t *o, d_t block, d_t cells, d_t i) {
+	for (;;) {
+		const d_t b = embed_patch_get(patch + *o);
+		if (b == 0xFFFF)
+			return h->o.read(h, i);
+		const d_t start = b * block, end = MIN(start + block, cells);
+		if (i < start)
+			return h->o.read(h, i);
+		if (i < end)
+			return embed_patch_get(patch + *o + 4 + (i - start) * 2);
+		*o += 4 + (end - start) * 2;
+	}
+}
+
+static m_t embed_patched_crc(embed_t const * const h, const uint8_t *patch, d_t block, d_t cells) { /* as computed by 'bist' */
+	size_t o = EMBED_PATCH_HEADER;
+	const size_t length = MIN(embed_patched(h, patch, &o, block, cells, EMBED_HEADER_LEN), embed_length(h)) / 2;
+	m_t crc = 0xFFFF;
+	o = EMBED_PATCH_HEADER;
+	for (size_t i = 0; i < length; i++) {
+		const m_t c = i == EMBED_HEADER_CRC ? 0 : embed_patched(h, patch, &o, block, cells, i);
+		const uint8_t b[2] = { c & 255, c >> 8 };
+		crc = embed_crc(crc, b, sizeof b);
+	}
+	return crc;
+}
+
+int embed_patch(embed_t *h, const uint8_t *patch, size_t length) {
+	assert(h && patch);
+	const embed_mmu_read_t  mr = h->o.read;
+	const embed_mmu_write_t mw = h->o.write;
+	if (length < (EMBED_PATCH_HEADER + 2) || memcmp(patch, embed_patch_magic, sizeof embed_patch_magic))
+		return -1;
+	const m_t block = embed_patch_get(patch + 4), cells = embed_patch_get(patch + 6);
+	if (!block || cells <= EMBED_HEADER_CRC || cells > EMBED_CORE_SIZE || embed_cells(h) <= EMBED_HEADER_CRC)
+		return -1;
+	const int live = mr(h, EMBED_HEADER_CRC) == 0;
+	if (mr(h, EMBED_HEADER_LEN) != embed_patch_get(patch + 8))
+		return -2; /* patch is for a different image */
+	if (!live && mr(h, EMBED_HEADER_CRC) != embed_patch_get(patch + 10))
+		return -2;
+	size_t o = EMBED_PATCH_HEADER;
+	for (d_t next = 0;;) { /* check everything before writing anything */
+		if ((o + 2) > length)
+			return -1;
+		const d_t b = embed_patch_get(patch + o);
+		if (b == 0xFFFF)
+			break;
+		const d_t start = b * block, end = MIN(start + block, (d_t)cells);
+		if (b < next || start >= end || (o + 4 + (end - start) * 2) > length)
+			return -1;
+		if (embed_crc(0xFFFF, patch + o + 4, (end - start) * 2) != embed_patch_get(patch + o + 2))
+			return -3; /* corrupt patch */
+		next = b + 1;
+		o += 4 + (end - start) * 2;
+	}
+	if (!live) { /* the result must be the target image */
+		size_t c = EMBED_PATCH_HEADER;
+		const m_t crc = embed_patched(h, patch, &c, block, cells, EMBED_HEADER_CRC);
+		if (crc != embed_patch_get(patch + 12) || embed_patched_crc(h, patch, block, cells) != crc)
+			return -3;
+	}
+	for (o = EMBED_PATCH_HEADER; embed_patch_get(patch + o) != 0xFFFF; ) {
+		const d_t start = embed_patch_get(patch + o) * block, end = MIN(start + block, (d_t)cells);
+		for (d_t i = start; i < end; i++)
+			if (!live || (i > 3 && i != EMBED_HEADER_CRC)) /* a live image keeps its registers and stays live */
+				mw(h, i, embed_patch_get(patch + o + 4 + (i - start) * 2));
+		o += 4 + (end - start) * 2;
+	}
+	return 0;
+}
+
+/* The search order is at the 'context' given in the index, the same place
+ * in all images made from 'embed.fth' unless the host says otherwise, it is
+ * a list of word lists ending in zero. A word list holds its newest word,
+ * each word header is a link to the previous word, then a name (a length
+ * byte, the top three bits being flags, and the characters of the name) and
+ * the code after that, cell aligned. Links only ever point to lower addresses
+ * so a list that does not is corrupt. */
+static m_t embed_byte(embed_t const * const h, m_t b) { const m_t c = h->o.read(h, b >> 1); return (b & 1) ? c >> 8 : c & 0xFF; }
+static m_t embed_code(embed_t const * const h, m_t pwd) { return (pwd + 4 + (embed_byte(h, pwd + 2) & 0x1F)) >> 1; }
+
+static m_t embed_context(embed_symbols_t const * const s) { return (s->context ? s->context : EMBED_SYMBOL_CONTEXT) >> 1; }
+
+static int embed_symbols_stale(embed_t const * const h, embed_symbols_t const * const s) {
+	const embed_mmu_read_t mr = h->o.read;
+	for (size_t i = 0; i < EMBED_SYMBOL_LISTS; i++) {
+		const m_t list = mr(h, embed_context(s) + i), head = list ? mr(h, list >> 1) : 0;
+		if (list != s->lists[i] || head != s->heads[i])
+			return 1;
+		if (!list)
+			break;
+	}
+	return 0;
+}
+
+int embed_symbols_update(embed_t *h, embed_symbols_t *s) {
+	assert(h && s && (s->symbols || !(s->max)));
+	const embed_mmu_read_t mr = h->o.read;
+	if (s->names || (s->count && !embed_symbols_stale(h, s)))
+		return 0;
+	int r = 1;
+	s->count = 0;
+	memset(s->lists, 0, sizeof s->lists);
+	memset(s->heads, 0, sizeof s->heads);
+	for (size_t i = 0; i < EMBED_SYMBOL_LISTS; i++) {
+		const m_t list = mr(h, embed_context(s) + i);
+		if (!list)
+			break;
+		s->lists[i] = list;
+		s->heads[i] = mr(h, list >> 1);
+		size_t j = 0;
+		for (j = 0; j < i && s->lists[j] != list; j++)
+			;
+		if (j < i) /* word list is in the search order more than once */
+			continue;
+		for (m_t pwd = s->heads[i], prev = 0xFFFF; pwd && pwd < prev && (pwd >> 1) < EMBED_CORE_SIZE; prev = pwd, pwd = mr(h, pwd >> 1)) {
+			const embed_symbol_t sym = { .start = embed_code(h, pwd), .pwd = pwd };
+			size_t k = s->count;
+			if (k == s->max) { /* full: keep the lowest addresses */
+				r = -1;
+				if (!k || s->symbols[k - 1].start < sym.start)
+					continue;
+				k--;
+			} else {
+				s->count++;
+			}
+			for (; k && s->symbols[k - 1].start > sym.start; k--) /* insertion sort */
+				s->symbols[k] = s->symbols[k - 1];
+			s->symbols[k] = sym;
+		}
+	}
+	return r;
+}
+
+int embed_symbolize(embed_t *h, m_t pc, char *name, size_t length) {
+	assert(h && name && length);
+	embed_symbols_t *s = h->o.symbols;
+	name[0] = 0;
+	if (!s)
+		return -1;
+	(void)embed_symbols_update(h, s);
+	size_t lo = 0, hi = s->count; /* find the last word starting at or before 'pc' */
+	while (lo < hi) {
+		const size_t mid = lo + ((hi - lo) / 2);
+		if (s->symbols[mid].start <= pc)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!lo)
+		return -1;
+	const embed_symbol_t *sym = &s->symbols[lo - 1];
+	const size_t l = MIN(sym->name ? strlen(sym->name) : (size_t)(embed_byte(h, sym->pwd + 2) & 0x1F), length - 1);
+	for (size_t i = 0; i < l; i++)
+		name[i] = sym->name ? sym->name[i] : embed_byte(h, sym->pwd + 3 + i);
+	name[l] = 0;
+	return pc - sym->start;
+}
+
+/* Strings compiled by 'embed_eval_cached' are copied into the reserved area
+ * with the code compiled for them after the copy, so that a lookup can check
+ * it has found the same string and not just one with the same hash. The code
+ * is compiled in place by pointing the dictionary pointer at a free part of
+ * the area whilst ':noname' and ';' run. The free part has to be big enough
+ * for the code before it is compiled, so a string is first compiled at the
+ * top of the dictionary, which is free, to find out how big its code is, and
+ * then compiled again into the area; if the second attempt comes out bigger
+ * it is thrown away and the call fails. Compiled strings are run by
+ * pushing the address the virtual machine has stopped at onto the return
+ * stack and calling them, when they return the interpreter carries on from
+ * where it was, finds there is no more input and yields again. */
+static uint32_t embed_fnv1a(const char *s, size_t l) {
+	uint32_t h = 2166136261ul;
+	for (size_t i = 0; i < l; i++)
+		h = (h ^ (uint8_t)s[i]) * 16777619ul;
+	return h;
+}
+
+static int embed_snippets_reserve(embed_t *h, embed_snippets_t *c) {
+	if (c->end)
+		return 0;
+	const embed_mmu_read_t  mr = h->o.read;
+	const embed_mmu_write_t mw = h->o.write;
+	const size_t depth = embed_depth(h);
+	m_t state = 0, here = 0;
+	if (embed_eval(h, " ' here @ state\n") < 0 || embed_depth(h) != depth + 2)
+		return -1;
+	embed_pop(h, &state), embed_pop(h, &here);
+	if (!(here & 0x8000)) /* 'here' is ': here cp @ ;', it starts with a literal */
+		return -1;
+	const m_t cp = here & 0x7FFF, start = (mr(h, cp >> 1) + 1) & ~1u;
+	if (((unsigned long)start + c->size) >= 0x3FFFul) /* dictionary limit, see '?dictionary' */
+		return -1;
+	c->cp = cp, c->state = state, c->start = start, c->end = start + ((c->size + 1) & ~1u);
+	mw(h, cp >> 1, c->end);
+	return 0;
+}
+
+static int embed_snippet_same(embed_t *h, const embed_snippet_t *e, uint32_t hash, const char *s, size_t l) {
+	if (!(e->xt) || e->hash != hash || e->length != l)
+		return 0;
+	for (size_t i = 0; i < l; i++)
+		if (embed_byte(h, e->start + i) != (uint8_t)s[i])
+			return 0;
+	return 1;
+}
+
+static int embed_snippet_fits(const embed_snippets_t *c, unsigned long at, unsigned long need) {
+	if (at + need > c->end)
+		return 0;
+	for (size_t i = 0; i < c->max; i++) {
+		const embed_snippet_t *e = &c->snippets[i];
+		if (e->xt && at < e->end && e->start < at + need)
+			return 0;
+	}
+	return 1;
+}
+
+static long embed_snippet_place(const embed_snippets_t *c, unsigned long need) {
+	if (embed_snippet_fits(c, c->start, need))
+		return c->start;
+	for (size_t i = 0; i < c->max; i++)
+		if (c->snippets[i].xt && embed_snippet_fits(c, c->snippets[i].end, need))
+			return c->snippets[i].end;
+	return -1;
+}
+
+static embed_snippet_t *embed_snippet_free(embed_snippets_t *c) {
+	for (size_t i = 0; i < c->max; i++)
+		if (!(c->snippets[i].xt))
+			return &c->snippets[i];
+	return NULL;
+}
+
+static embed_snippet_t *embed_snippet_lru(embed_snippets_t *c) {
+	embed_snippet_t *r = NULL;
+	for (size_t i = 0; i < c->max; i++) {
+		embed_snippet_t *e = &c->snippets[i];
+		if (e->xt && (!r || e->used < r->used))
+			r = e;
+	}
+	return r;
+}
+
+static int embed_execute(embed_t *h, m_t xt) {
+	const embed_mmu_read_t  mr = h->o.read;
+	const embed_mmu_write_t mw = h->o.write;
+	m_t rp = mr(h, 2);
+	if (rp <= mr(h, 3) + 1)
+		return -3; /* stack overflow */
+	mw(h, --rp, mr(h, 0) << 1);
+	mw(h, 2, rp);
+	mw(h, 0, xt >> 1);
+	return embed_eval(h, "");
+}
+
+/* Compile 'str' as ':noname <str> ;' with the dictionary pointer set to
+ * 'code', giving its execution token and the byte address after it, the
+ * dictionary pointer is put back afterwards. */
+static int embed_snippet_compile(embed_t *h, embed_snippets_t *c, const char *str, m_t code, m_t *end, m_t *xt) {
+	const embed_mmu_read_t  mr = h->o.read;
+	const embed_mmu_write_t mw = h->o.write;
+	const m_t cp = mr(h, c->cp >> 1);
+	const size_t depth = embed_depth(h);
+	mw(h, c->cp >> 1, code);
+	int r = embed_eval(h, ":noname\n");
+	if (r >= 0)
+		r = embed_eval(h, str);
+	if (r >= 0)
+		r = embed_eval(h, "\n;\n");
+	*end = mr(h, c->cp >> 1);
+	mw(h, c->cp >> 1, cp);
+	if (r < 0 || mr(h, c->state >> 1) || embed_depth(h) != depth + 1 || embed_pop(h, xt) < 0 || *xt != code)
+		return r < 0 ? r : -1;
+	return 0;
+}
+
+int embed_eval_cached(embed_t *h, embed_snippets_t *c, const char *str) {
+	assert(h && c && str && (c->snippets || !(c->max)));
+	const embed_mmu_read_t  mr = h->o.read;
+	const embed_mmu_write_t mw = h->o.write;
+	if (embed_snippets_reserve(h, c) < 0)
+		return -1;
+	const size_t l = strlen(str);
+	const uint32_t hash = embed_fnv1a(str, l);
+	const int interpreting = !mr(h, c->state >> 1);
+	c->clock++;
+	for (size_t i = 0; interpreting && i < c->max; i++) {
+		embed_snippet_t *e = &c->snippets[i];
+		if (embed_snippet_same(h, e, hash, str, l)) {
+			e->used = c->clock;
+			c->hits++;
+			return embed_execute(h, e->xt);
+		}
+	}
+	c->misses++;
+	const unsigned long text = (l + 1) & ~1ul;
+	const m_t here = mr(h, c->cp >> 1);
+	m_t end = 0, xt = 0;
+	if (!interpreting || !(c->max) || l >= 0x8000ul || text > (unsigned long)(c->end - c->start)) {
+		const int r = embed_eval(h, str);
+		return r < 0 ? r : embed_eval(h, "\n");
+	}
+	int r = embed_snippet_compile(h, c, str, here, &end, &xt); /* measure it */
+	if (r < 0)
+		return r;
+	const unsigned long need = text + (end - here);
+	if (need > (unsigned long)(c->end - c->start)) {
+		r = embed_eval(h, str);
+		return r < 0 ? r : embed_eval(h, "\n");
+	}
+	embed_snippet_t *e = NULL;
+	long at = -1;
+	while (!(e = embed_snippet_free(c)) || (at = embed_snippet_place(c, need)) < 0) {
+		embed_snippet_t *lru = embed_snippet_lru(c); /* an empty area always has room */
+		assert(lru);
+		lru->xt = 0;
+	}
+
+	for (size_t i = 0; i < l; i += 2)
+		mw(h, (at + i) >> 1, (uint8_t)str[i] | ((i + 1) < l ? (m_t)((uint8_t)str[i + 1]) << 8 : 0));
+	if ((r = embed_snippet_compile(h, c, str, at + text, &end, &xt)) < 0)
+		return r;
+	if (end > at + need) { /* compiled to a different size the second time */
+		for (size_t i = 0; i < c->max; i++)
+			if (c->snippets[i].start < end && c->snippets[i].end > at)
+				c->snippets[i].xt = 0;
+		return -1;
+	}
+	e->hash = hash, e->start = at, e->end = (end + 1) & ~1u, e->length = l, e->xt = xt, e->used = c->clock;
+	return embed_execute(h, xt);
+}
+
 int embed_puts(embed_t *h, const char *s) {
 	assert(h && s);
 	embed_opt_t *o = &(h->o);
@@ -140,12 +744,9 @@ embed_opt_t embed_opt_default(void) {
 	return o;
 }
 
-#ifdef NDEBUG
-#define trace(VM,PC,INSTRUCTION,T,RP,SP)
-#else
 static int extend(uint16_t dd) { return (dd & 2) ? (s_t)(dd | 0xFFFE) : dd; }
 
-static int disassemble(m_t instruction, char *output, size_t length) {
+int embed_disassemble(m_t instruction, char *output, size_t length) {
 	assert(output);
 	if ((0x8000 & instruction)) {
 		return snprintf(output, length, "literal %04x", (unsigned)(0x1FFF & instruction));
@@ -167,53 +768,140 @@ static int disassemble(m_t instruction, char *output, size_t length) {
 	}
 }
 
+int embed_trace_format(embed_t *h, const embed_trace_record_t *r, char *output, size_t length) {
+	assert(h && r && output);
+	char name[32] = { 0 }, code[64] = { 0 }, target[40] = { 0 }, word[48] = { 0 };
+	embed_disassemble(r->instruction, code, sizeof code);
+	if ((0xE000 & r->instruction) != 0x6000 && !(0x8000 & r->instruction)) /* call or branch target */
+		if (embed_symbolize(h, r->instruction & 0x1FFF, name, sizeof name) >= 0)
+			snprintf(target, sizeof target, " %s", name);
+	const int offset = embed_symbolize(h, r->pc, name, sizeof name);
+	if (offset >= 0)
+		snprintf(word, sizeof word, " ( %s+%d )", name, offset);
+	return snprintf(output, length, "[ %4x %4x %4x %2x %2x : %s%s%s ]\n",
+			r->pc, r->instruction, r->t, r->rp, r->sp, code, target, word);
+}
+
+/* An image sets the fields of the trace filter one at a time, with field 0
+ * being 'start', 1 'end', 2 'classes' and 3 'every', so it can trace the
+ * words it is interested in without help from the host. */
+static inline void embed_trace_filter(embed_trace_filter_t *f, m_t field, m_t value) {
+	switch (field) {
+	case 0: f->start   = value; break;
+	case 1: f->end     = value; break;
+	case 2: f->classes = value; break;
+	case 3: f->every   = value; f->skipped = 0; break;
+	}
+}
+
+int embed_stats(embed_t *h, embed_stats_t *out) {
+	assert(h && out);
+	if (!EMBED_STATS || !h->o.stats) {
+		memset(out, 0, sizeof *out);
+		return -1;
+	}
+	*out = *h->o.stats;
+	return 0;
+}
+
+static inline d_t embed_stat(const embed_stats_t *stats, m_t counter) {
+	return EMBED_STATS && stats && counter < EMBED_STAT_MAX ? (d_t)stats->count[counter] : 0;
+}
+
+#ifdef NDEBUG
+#define trace(VM,PC,INSTRUCTION,T,RP,SP)
+#else
+static inline unsigned embed_trace_class(m_t instruction) {
+	if (0x8000 & instruction)
+		return EMBED_TRACE_LITERAL;
+	if ((0xE000 & instruction) == 0x6000) {
+		const unsigned alu = (instruction >> 8) & 0x1F;
+		const int io = alu == 22 || alu == 23 || alu == 24 || alu == 28;
+		return io ? EMBED_TRACE_ALU | EMBED_TRACE_IO : EMBED_TRACE_ALU;
+	}
+	if (0x4000 & instruction)
+		return EMBED_TRACE_CALL;
+	return (0x2000 & instruction) ? EMBED_TRACE_0BRANCH : EMBED_TRACE_BRANCH;
+}
+
+/* Binary traces cost a few stores an instruction, so they can be left on,
+ * text traces are formatted and written out as they are made. */
 static inline void trace(embed_t *h, m_t pc, m_t instruction, m_t t, m_t rp, m_t sp) {
 	embed_opt_t *o = &(h->o);
-	if (!(o->options & EMBED_VM_TRACE_ON) || !(o->put))
+	if (!(o->options & EMBED_VM_TRACE_ON))
+		return;
+	embed_trace_filter_t *f = &o->filter;
+	const m_t at = pc - 1;
+	if (f->end && (at < f->start || at >= f->end))
+		return;
+	if (f->classes && !(f->classes & embed_trace_class(instruction)))
 		return;
+	if (f->every > 1 && ++f->skipped < f->every)
+		return;
+	f->skipped = 0;
 	const embed_mmu_read_t  mr = o->read;
 	assert(mr);
-	char buf[64] = { 0 };
-	snprintf(buf, sizeof buf, "[ %4x %4x %4x %2x %2x : ", pc - 1, instruction, t, (m_t)(mr(h, 2 + SHADOW) - rp), (m_t)(sp - mr(h, 3 + SHADOW)));
-	embed_puts(h, buf);
-	disassemble(instruction, buf, sizeof buf);
+	const embed_trace_record_t r = {
+		.pc = pc - 1, .instruction = instruction, .t = t,
+		.rp = mr(h, 2 + SHADOW) - rp, .sp = sp - mr(h, 3 + SHADOW),
+	};
+	embed_trace_t *b = o->trace;
+	if (b) {
+		b->records[b->count++ & (b->length - 1)] = r;
+		return;
+	}
+	if (!(o->put))
+		return;
+	char buf[160] = { 0 };
+	embed_trace_format(h, &r, buf, sizeof buf);
 	embed_puts(h, buf);
-	embed_puts(h, " ]\n");
 }
 #endif
 
-int embed_vm(embed_t * const h) {
-	assert(h);
-	BUILD_BUG_ON (sizeof(m_t)    != sizeof(s_t));
-	BUILD_BUG_ON((sizeof(m_t)*2) != sizeof(d_t));
+/* With 'EMBED_VM_UNCHECKED' the registers are not checked against the size of
+ * the image before every instruction, so a program that runs its stacks or
+ * program counter out of bounds is not stopped. Every address made from a
+ * register is wrapped around within the core instead, in both modes, so the
+ * virtual machine never touches memory outside of it, and '@' and '!' wrap
+ * with a mask rather than a division. Only the host can set the option, the
+ * image cannot, and the checks are cheap next to the calls through the
+ * memory and yield callbacks, so it makes little difference to speed. */
+#define EMBED_MASK         (EMBED_CORE_SIZE - 1)
+
+static inline int embed_run(embed_t * const h, const int checked) {
 	embed_opt_t *o = &(h->o);
 	static const m_t delta[] = { 0, 1, -2, -1 }; /* two bit signed value */
 	const embed_mmu_read_t  mr    = o->read;
 	const embed_mmu_write_t mw    = o->write;
 	const embed_yield_t     yield = o->yield;
 	void  *yields = o->yields;
+	volatile sig_atomic_t * const preempt = o->preempt;
+	embed_stats_t * const stats = o->stats;
 	assert(mr && mw && yield);
 	const m_t l = embed_cells(h);
 	m_t pc = mr(h, 0), t = mr(h, 1), rp = mr(h, 2), sp = mr(h, 3), r = 0;
 	for (d_t d; !yield(yields); ) {
-		const m_t instruction = mr(h, pc++);
+		const m_t instruction = mr(h, EMBED_MASK & pc++);
 		trace(h, pc, instruction, t, rp, sp);
-		if ((r = -!(sp < l && rp < l && pc < l))) /* critical error */
+		if (checked && (r = -!(sp < l && rp < l && pc < l))) /* critical error */
 			goto finished;
 		if (0x8000 & instruction) { /* literal */
-			mw(h, ++sp, t);
+			embed_count(stats, EMBED_STAT_LITERAL);
+			mw(h, EMBED_MASK & ++sp, t);
 			t       = instruction & 0x7FFF;
 		} else if ((0xE000 & instruction) == 0x6000) { /* ALU */
-			m_t n = mr(h, sp), T = t;
-			pc = (instruction & 0x10) ? (mr(h, rp) >> 1) : pc;
+			m_t n = mr(h, EMBED_MASK & sp), T = t;
+			embed_count(stats, EMBED_STAT_ALU);
+			embed_count(stats, EMBED_STAT_ALU_OP + ((instruction >> 8u) & 0x1f));
+			pc = (instruction & 0x10) ? (mr(h, EMBED_MASK & rp) >> 1) : pc;
 			switch((instruction >> 8u) & 0x1f) {
 			case  0:  T = t;                  break;
 			case  1:  T = n;                  break;
-			case  2:  T = mr(h, rp);          break;
-			case  3:  T = mr(h, (t>>1)%l);    break;
-			case  4:  mw(h, (t>>1)%l, n); T = mr(h, --sp); break;
-			case  5:  d = (d_t)t + n; T = d >> 16; mw(h, sp, d); n = d; break;
-			case  6:  d = (d_t)t * n; T = d >> 16; mw(h, sp, d); n = d; break;
+			case  2:  T = mr(h, EMBED_MASK & rp);          break;
+			case  3:  T = mr(h, checked ? (t>>1)%l : EMBED_MASK & (t>>1)); break;
+			case  4:  mw(h, checked ? (t>>1)%l : EMBED_MASK & (t>>1), n); T = mr(h, EMBED_MASK & --sp); break;
+			case  5:  d = (d_t)t + n; T = d >> 16; mw(h, EMBED_MASK & sp, d); n = d; break;
+			case  6:  d = (d_t)t * n; T = d >> 16; mw(h, EMBED_MASK & sp, d); n = d; break;
 			case  7:  T = t&n;                break;
 			case  8:  T = t|n;                break;
 			case  9:  T = t^n;                break;
@@ -229,39 +917,88 @@ int embed_vm(embed_t * const h) {
 			case 19:  T = rp << 1;            break;
 			case 20: sp = t >> 1;             break;
 			case 21: rp = t >> 1; T = n;      break;
-			case 22: if (o->save) { T = o->save(h, o->name, n >> 1, ((d_t)t + 1) >> 1); } else { pc = 4; T = 21; } break;
-			case 23: if (o->put) { T = o->put(t, o->out); } else { pc = 4; T = 21; } break;
-			case 24: if (o->get) { int nd = 0; mw(h, ++sp, t); T = o->get(o->in, &nd); t = T; n = nd; } else { pc = 4; T = 21; } break;
-			case 25: if (t) { d = mr(h, --sp) | ((d_t)n << 16); T= d / t; t = d % t; n = t; } else { pc = 4; T=10; } break;
+			case 22: if (o->save) {
+					 embed_count(stats, EMBED_STAT_SAVE);
+					 T = o->save(h, o->name, n >> 1, ((d_t)t + 1) >> 1);
+				 } else { pc = 4; T = 21; } break;
+			case 23: if (o->put) {
+					 const int ch = o->put(t, o->out);
+					 embed_count(stats, EMBED_STAT_PUT);
+					 if (ch >= 0)
+						 embed_count(stats, EMBED_STAT_BYTES_OUT);
+					 T = ch;
+				 } else { pc = 4; T = 21; } break;
+			case 24: if (o->get) {
+					 int nd = 0;
+					 mw(h, EMBED_MASK & ++sp, t);
+					 const int ch = o->get(o->in, &nd);
+					 embed_count(stats, EMBED_STAT_GET);
+					 if (ch >= 0)
+						 embed_count(stats, EMBED_STAT_BYTES_IN);
+					 T = ch; t = T; n = nd;
+				 } else { pc = 4; T = 21; } break;
+			case 25: if (t) { d = mr(h, EMBED_MASK & --sp) | ((d_t)n << 16); T= d / t; t = d % t; n = t; } else { pc = 4; T=10; } break;
 			case 26: if (t) { T=(s_t)n / t; t=(s_t)n % t; n = t; } else { pc = 4; T = 10; } break;
-			case 27: if (mr(h, rp)) { mw(h, rp, 0); sp--; r = t; t = n; goto finished; }; T = t; break;
+			case 27: if (mr(h, EMBED_MASK & rp)) { mw(h, EMBED_MASK & rp, 0); sp--; r = t; t = n; embed_count(stats, EMBED_STAT_YIELD); goto finished; }; T = t; break;
 			case 28: if (o->callback) {
+					 embed_count(stats, EMBED_STAT_CALLBACK);
 					 mw(h, 0, pc), mw(h, 1, t), mw(h, 2, rp), mw(h, 3, sp);
 					 r = o->callback(h, o->param);
 					 pc = mr(h, 0), T = mr(h, 1), rp = mr(h, 2), sp = mr(h, 3);
 					 if (r) { pc = 4; T = r; }
 				 } else { pc = 4; T = 21; }  break;
-			case 29: T = o->options; o->options = t; break;
+			case 29: T = o->options; o->options = (t & ~EMBED_VM_UNCHECKED) | (o->options & EMBED_VM_UNCHECKED); break;
+			case 30: embed_trace_filter(&o->filter, t, n); T = mr(h, EMBED_MASK & --sp); break;
+			case 31: d = embed_stat(stats, t); T = d >> 16; t = d; break;
 			default: pc = 4; T = 21; /* not implemented */ break;
 			}
 			sp += delta[ instruction       & 0x3];
 			rp -= delta[(instruction >> 2) & 0x3];
 			if (instruction & 0x80)
-				mw(h, sp, t);
+				mw(h, EMBED_MASK & sp, t);
 			if (instruction & 0x40)
-				mw(h, rp, t);
+				mw(h, EMBED_MASK & rp, t);
 			t = (instruction & 0x20) ? n : T;
 		} else if (0x4000 & instruction) { /* call */
-			mw(h, --rp, pc << 1);
+			embed_count(stats, EMBED_STAT_CALL);
+			mw(h, EMBED_MASK & --rp, pc << 1);
 			pc      = instruction & 0x1FFF;
+			if (preempt && *preempt)
+				goto preempted;
 		} else if (0x2000 & instruction) { /* 0branch */
+			const m_t from = pc;
+			embed_count(stats, EMBED_STAT_0BRANCH);
+			if (!t)
+				embed_count(stats, EMBED_STAT_0BRANCH_TAKEN);
 			pc = !t ? instruction & 0x1FFF : pc;
-			t  = mr(h, sp--);
+			t  = mr(h, EMBED_MASK & sp--);
+			if (pc < from && preempt && *preempt)
+				goto preempted;
 		} else { /* branch */
+			const m_t from = pc;
+			embed_count(stats, EMBED_STAT_BRANCH);
 			pc = instruction & 0x1FFF;
+			if (pc < from && preempt && *preempt)
+				goto preempted;
 		}
 	}
+	embed_count(stats, EMBED_STAT_YIELD); /* the yield callback stopped it */
+	mw(h, 0, pc), mw(h, 1, t), mw(h, 2, rp), mw(h, 3, sp);
+	return EMBED_YIELDED;
 finished: mw(h, 0, pc), mw(h, 1, t), mw(h, 2, rp), mw(h, 3, sp);
 	return (s_t)r;
+preempted: /* only loops and calls are checked, code that does neither ends soon enough */
+	*preempt = 0;
+	embed_count(stats, EMBED_STAT_YIELD);
+	mw(h, 0, pc), mw(h, 1, t), mw(h, 2, rp), mw(h, 3, sp);
+	return EMBED_PREEMPTED;
+}
+
+int embed_vm(embed_t * const h) {
+	assert(h);
+	BUILD_BUG_ON (sizeof(m_t)    != sizeof(s_t));
+	BUILD_BUG_ON((sizeof(m_t)*2) != sizeof(d_t));
+	const int unchecked = (h->o.options & EMBED_VM_UNCHECKED) && embed_cells(h) == EMBED_CORE_SIZE;
+	return unchecked ? embed_run(h, 0) : embed_run(h, 1);
 }
 
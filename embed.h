@@ -12,10 +12,13 @@
 #ifdef __cplusplus
 extern "C" {
 #endif
+#include <signal.h>
 #include <stddef.h>
 #include <stdint.h>
 
 #define EMBED_CORE_SIZE (32768uL)      /**< core size in cells */
+#define EMBED_PREEMPTED (0x10000)      /**< returned by 'embed_vm' when it has been preempted */
+#define EMBED_YIELDED   (0x10001)      /**< returned by 'embed_vm' when the yield callback stopped it */
 
 typedef uint16_t cell_t;               /**< Virtual Machine Cell size: 16-bit*/
 typedef  int16_t signed_cell_t;        /**< Virtual Machine Signed Cell */
@@ -36,7 +39,10 @@ typedef struct embed_t embed_t; /**< Forth Virtual Machine State Type Define */
  * @param no_data, a pointer to integer to place the blocking status of this
  * function. If there is no data to be had at the moment and you do not want
  * to block waiting for more, set the 'no_data' variable to -1, otherwise set
- * this to zero.
+ * this to zero. It is zero on entry. Rather than give up straight away a
+ * function may wait a while for input first, so that the image does not
+ * yield after every key, how long for is up to the function (see
+ * 'embed_channel_wait' in "pool.h" for example).
  * @return int, return EOF (-1) on no more input/failure, and an unsigned 8-bit
  * character value on success. */
 typedef int (*embed_fgetc_t)(void *file, int *no_data);
@@ -86,18 +92,112 @@ typedef void (*embed_mmu_write_t)(embed_t * const h, cell_t addr, cell_t value);
 
 /**@brief This function is called by the virtual machine to determine whether
  * the virtual machine should yield or not, it can be used to limit time spent
- * in the virtual machine.
+ * in the virtual machine. 'embed_vm' returns 'EMBED_YIELDED' when it does.
  * @param param, arbitrary data to supply to the yield function
  * @return returns non zero if virtual machine should yield, and zero if it
  * should continue */
 typedef int (*embed_yield_t)(void *param);
 
 typedef enum {
-	EMBED_VM_TRACE_ON     = 1u << 0, /**< turn tracing on */
+	EMBED_VM_TRACE_ON     = 1u << 0, /**< turn tracing on, see the 'trace' and 'filter' options */
 	EMBED_VM_RAW_TERMINAL = 1u << 1, /**< raw terminal mode */
 	EMBED_VM_QUITE_ON     = 1u << 2, /**< turn off 'ok' prompt and welcome message */
+	EMBED_VM_COMPRESS     = 1u << 3, /**< compress images written by the default save callback */
+	EMBED_VM_SPARSE       = 1u << 4, /**< save images as a list of non-zero extents */
+	EMBED_VM_UNCHECKED    = 1u << 5, /**< do not stop when a register is out of bounds, wrap it around the core, only the host can set this */
 } embed_vm_option_e; /**< VM option enum */
 
+#define EMBED_SYMBOL_LISTS  (8)       /**< maximum word lists in the eForth search order */
+#define EMBED_SYMBOL_CONTEXT (0x401Au) /**< byte address of the search order, 'context', in images made from 'embed.fth' */
+
+typedef struct {
+	cell_t start;     /**< cell address of the code of a word */
+	cell_t pwd;       /**< byte address of the header of that word */
+	const char *name; /**< name from a name table, NULL if it is read from the header */
+} embed_symbol_t; /**< An entry in an index from code addresses to words */
+
+typedef struct {
+	embed_symbol_t *symbols;          /**< storage for the index, supplied by the user */
+	size_t max,                       /**< number of entries 'symbols' can hold */
+	       count;                     /**< number of entries in use, sorted by 'start' */
+	char *names;                      /**< names from 'embed_symbols_load', which is never rebuilt */
+	cell_t context;                   /**< byte address of the search order, zero for 'EMBED_SYMBOL_CONTEXT' */
+	cell_t lists[EMBED_SYMBOL_LISTS], /**< word lists the index was built from... */
+	       heads[EMBED_SYMBOL_LISTS]; /**< ...and the words at their heads */
+} embed_symbols_t; /**< Index from code addresses to the words they belong to */
+
+typedef struct {
+	cell_t pc,          /**< cell address of the instruction */
+	       instruction, /**< the instruction itself */
+	       t,           /**< top of the variable stack before it ran */
+	       rp,          /**< depth of the return stack, in cells */
+	       sp;          /**< depth of the variable stack, in cells */
+} embed_trace_record_t; /**< A record of one instruction in a binary trace */
+
+typedef enum {
+	EMBED_TRACE_LITERAL = 1u << 0, /**< literals */
+	EMBED_TRACE_ALU     = 1u << 1, /**< ALU instructions */
+	EMBED_TRACE_CALL    = 1u << 2, /**< calls */
+	EMBED_TRACE_0BRANCH = 1u << 3, /**< conditional branches */
+	EMBED_TRACE_BRANCH  = 1u << 4, /**< branches */
+	EMBED_TRACE_IO      = 1u << 5, /**< ALU instructions that do I/O, save or call the callback */
+} embed_trace_class_e; /**< Classes of instruction that traces can be limited to */
+
+typedef struct {
+	cell_t start, end;     /**< only trace 'start <= pc < end', as cell addresses, if 'end' is not zero */
+	unsigned classes;      /**< only trace instructions in these classes, if not zero */
+	unsigned long every,   /**< only trace one in 'every' instructions, if more than one */
+		      skipped; /**< instructions passed over since the last one traced */
+} embed_trace_filter_t; /**< Limits which instructions are traced, it is all of them if zeroed */
+
+typedef struct {
+	embed_trace_record_t *records; /**< ring buffer of records, supplied by the user */
+	size_t length;                 /**< number of records, which must be a power of two */
+	uint64_t count;                /**< records made in total, the last is at '(count - 1) % length' */
+} embed_trace_t; /**< A binary trace of the last 'length' instructions run */
+
+typedef enum {
+	EMBED_STAT_LITERAL,       /**< literals run */
+	EMBED_STAT_ALU,           /**< ALU instructions run */
+	EMBED_STAT_CALL,          /**< calls run */
+	EMBED_STAT_0BRANCH,       /**< conditional branches run... */
+	EMBED_STAT_0BRANCH_TAKEN, /**< ...and how many of them branched */
+	EMBED_STAT_BRANCH,        /**< branches run */
+	EMBED_STAT_ALU_OP,        /**< first of 32 counts, one for each ALU operation */
+	EMBED_STAT_GET = EMBED_STAT_ALU_OP + 32, /**< calls to the 'get' callback */
+	EMBED_STAT_PUT,           /**< calls to the 'put' callback */
+	EMBED_STAT_SAVE,          /**< calls to the 'save' callback */
+	EMBED_STAT_CALLBACK,      /**< calls to the 'callback' callback */
+	EMBED_STAT_YIELD,         /**< times 'embed_vm' returned other than on an error: 'bye', the yield callback or preemption */
+	EMBED_STAT_BYTES_IN,      /**< bytes read by 'get' */
+	EMBED_STAT_BYTES_OUT,     /**< bytes written by 'put' */
+	EMBED_STAT_MAX,           /**< number of counters */
+} embed_stat_e; /**< Counters kept in 'embed_stats_t' */
+
+typedef struct {
+	unsigned long count[EMBED_STAT_MAX]; /**< indexed by 'embed_stat_e' */
+} embed_stats_t; /**< Counts of what the virtual machine has done */
+
+typedef struct {
+	uint32_t hash;      /**< hash of the string, an entry is in use if 'xt' is not zero */
+	cell_t start,       /**< byte address the copy of the string starts at... */
+	       end,         /**< ...and the byte address after the compiled code */
+	       length,      /**< length of the string */
+	       xt;          /**< execution token of the compiled string */
+	unsigned long used; /**< when the entry was last used, for LRU eviction */
+} embed_snippet_t; /**< A string compiled by 'embed_eval_cached' */
+
+typedef struct {
+	embed_snippet_t *snippets; /**< storage for the cache entries, supplied by the user */
+	size_t max;                /**< number of entries 'snippets' can hold */
+	cell_t size;               /**< bytes of dictionary to reserve for compiled strings */
+	cell_t start, end,         /**< byte addresses of the reserved area, zero until reserved */
+	       cp, state;          /**< byte addresses of eForth's 'cp' and 'state' */
+	unsigned long clock,       /**< counts uses, to time stamp entries */
+		      hits,        /**< number of calls that ran a cached string */
+		      misses;      /**< number of calls that had to compile, or evaluate, a string */
+} embed_snippets_t; /**< Cache of compiled strings for 'embed_eval_cached' */
+
 typedef struct {
 	embed_fgetc_t     get;      /**< callback to get a character, behaves like 'fgetc' */
 	embed_fputc_t     put;      /**< callback to output a character, behaves like 'fputc' */
@@ -112,6 +212,11 @@ typedef struct {
 		*yields;            /**< parameter to yield */
 	const void *name;           /**< second argument to 'save' */
 	embed_vm_option_e options;  /**< virtual machine options register */
+	embed_symbols_t *symbols;   /**< optional index used to add word names to traces */
+	volatile sig_atomic_t *preempt; /**< optional flag, set by a timer, that stops 'embed_vm' */
+	embed_trace_t *trace;       /**< optional ring buffer that traces are recorded in, instead of text */
+	embed_trace_filter_t filter; /**< which instructions are traced, also set by the image */
+	embed_stats_t *stats;       /**< optional counters, zeroed by the user, see 'embed_stats' */
 } embed_opt_t; /**< Embed VM options structure for customizing behavior */
 
 struct embed_t { /**@todo merge with embed_opt_t */
@@ -164,13 +269,32 @@ void embed_mmu_write_cb(embed_t * const h, cell_t addr, cell_t value);
  * @return zero on success, negative on failure */
 int embed_load(embed_t *h, const char *name);
 
-/**@brief Load VM image from memory
+/**@brief Load VM image from memory, which may be compressed or sparse
  * @param h,      uninitialized Virtual Machine image
  * @param buf,    byte buffer to load from
  * @param length, length of 'buf'
  * @return zero on success, negative on failure */
 int embed_load_buffer(embed_t *h, const uint8_t *buf, size_t length);
 
+/**@brief Load VM image from a stream of bytes, either a raw image, a
+ * compressed image (as made by 'embed_compress') or a sparse image is
+ * accepted, compressed images are decompressed into the core as they are
+ * read and the gaps in sparse images are zero filled.
+ * @param h,   uninitialized Virtual Machine image
+ * @param get, callback to read a byte from the stream, returning EOF at the end
+ * @param in,  first argument to 'get'
+ * @return zero on success, negative on failure */
+int embed_load_stream(embed_t *h, embed_fgetc_t get, void *in);
+
+/**@brief Compress a raw image into the compressed image format accepted by
+ * the image loading functions.
+ * @param out,        buffer to write compressed image to
+ * @param out_length, length of 'out', set to the compressed length on success
+ * @param in,         raw image, in the little endian on disk format
+ * @param in_length,  length of 'in' in bytes
+ * @return zero on success, negative on failure ('out' too small) */
+int embed_compress(uint8_t *out, size_t *out_length, const uint8_t *in, size_t in_length);
+
 /**@brief Load the default configuration options for the embed virtual machine
  * and the default image as well.
  * @param h, an uninitialized
@@ -198,8 +322,18 @@ void embed_buffer_swap(cell_t *b, size_t l);
  * options structure contains the callbacks and the data the callbacks might
  * require. You should call this function if you need to customize the virtual
  * machines behavior so it reads or writes to different I/O sources.
+ *
+ * If the 'preempt' option is set the virtual machine checks the flag it
+ * points to on every call and backward jump, if the flag is non zero it is
+ * cleared and 'EMBED_PREEMPTED' is returned. The registers are saved so that
+ * calling 'embed_vm' again carries on where it left off. The flag would
+ * usually be set from a signal handler, by an interval timer, so that each
+ * call to 'embed_vm' runs for a time slice at most, even if the program in it
+ * is stuck in a loop.
  * @param h, initialized virtual machine
- * @return zero on success, negative on failure */
+ * @return zero on success, negative on failure, 'EMBED_PREEMPTED' if it was
+ * preempted, 'EMBED_YIELDED' if the yield callback stopped it, other values
+ * may be returned by the image with 'bye' */
 int embed_vm(embed_t *h);
 
 /**@brief Push value onto the Virtual Machines stack. This can be called from
@@ -262,6 +396,113 @@ cell_t *embed_core_get(embed_t *h);
  * @return zero on success, negative on failure */
 int embed_eval(embed_t *h, const char *str);
 
+/**@brief Evaluate a string like 'embed_eval', but compile it the first time
+ * it is seen (as ':noname <str> ;' would) into an area of the dictionary set
+ * aside for the cache, and run the compiled code on later calls, skipping the
+ * parsing and dictionary searches. The area is reserved by the first call,
+ * the oldest entries are evicted to make room when it fills up. The string
+ * must be something that can be compiled into a word definition and that
+ * does not parse the input stream, as the compiled code is run without any
+ * input, and it must compile to the same code each time. A string is compiled
+ * once at the top of the dictionary to size it before it is compiled into
+ * the area, so words it runs whilst compiling are run twice. If the
+ * interpreter is compiling when this is called, or the code is too big for
+ * the area, the string is evaluated instead. Words are looked up when a
+ * string is compiled, so a cached string keeps calling the old definition of
+ * a word that is redefined later, zero the cache to pick up the new one. The
+ * cache must be zeroed (apart from the user supplied fields) if the image is
+ * reloaded or the virtual machine is reset.
+ * @param h,   virtual machine to evaluate the string with
+ * @param c,   cache of compiled strings, 'snippets', 'max' and 'size' must be
+ * set by the user, all other fields zeroed
+ * @param str, string to evaluate, it is run as if it ended in a new line
+ * @return same as 'embed_eval', negative if the string could not be compiled
+ * (the interpreter will have said why), if it compiled to more code than it
+ * did when it was sized, or if the area could not be reserved */
+int embed_eval_cached(embed_t *h, embed_snippets_t *c, const char *str);
+
+/**@brief Compute a block level binary delta between two images, which can be
+ * applied with 'embed_patch'.
+ * @param from,       image the patch is to be applied to
+ * @param to,         image that applying the patch results in
+ * @param out,        buffer to write the patch to
+ * @param out_length, length of 'out', set to the patch length on success
+ * @return zero on success, negative on failure ('out' too small) */
+int embed_diff(embed_t const * const from, embed_t const * const to, uint8_t *out, size_t *out_length);
+
+/**@brief Apply a patch made by 'embed_diff' to an image, which may be a
+ * running virtual machine stopped at a yield. The image must be the one the
+ * patch was made from, which is checked with the length and CRC in the eForth
+ * image header. Everything is checked before anything is written, each block
+ * against its CRC and, for an image that has just been loaded, the image that
+ * would result against the header CRC of the target, as 'bist' would. A live
+ * image (one that has booted and so zeroed its header CRC, which marks it as
+ * live) has its registers (cells 0 to 3) and its header CRC left alone, so it
+ * can continue where it left off and stays live for later patches. This is
+ * only safe if the code it is executing is not moved by the patch. The image
+ * a live patch is made from cannot be checked, as its memory has changed
+ * whilst running.
+ * @param h,      image to patch
+ * @param patch,  patch to apply
+ * @param length, length of 'patch' in bytes
+ * @return zero on success, -2 if the patch is for another image, -3 if the
+ * patch is corrupt or the result is not the target image, and -1 on other
+ * failures */
+int embed_patch(embed_t *h, const uint8_t *patch, size_t length);
+
+/**@brief Bring an index from code addresses to words up to date, it is built
+ * from the headers of the word lists in the eForth search order, found at
+ * the 'context' address in 's', and only rebuilt if those lists, or the words
+ * at their heads, have changed since it was last built. The index is only
+ * used by the host, for traces, the image itself does not use it and words
+ * such as 'see' and '.name' still search the word lists one word at a time. If 'symbols' is too small the index holds the words with
+ * the lowest addresses. An index loaded from a name table, for an image
+ * without headers, is left as it is.
+ * @param h, virtual machine with an eForth image
+ * @param s, index to update
+ * @return one if the index was rebuilt, zero if it was already up to date,
+ * negative if it was rebuilt but 's' was too small to hold all the words */
+int embed_symbols_update(embed_t *h, embed_symbols_t *s);
+
+/**@brief Disassemble an instruction, as is done in traces
+ * @param instruction, instruction to disassemble
+ * @param output, buffer to write the ASCII NUL terminated text to
+ * @param length, size of 'output'
+ * @return as 'snprintf' */
+int embed_disassemble(cell_t instruction, char *output, size_t length);
+
+/**@brief Format a trace record as a line of text, in the format used when
+ * traces are output as text. If an index is set in the options the names of
+ * words are added, 'h' should have the image the trace was made with.
+ * @param h, virtual machine to look up names in
+ * @param r, record to format
+ * @param output, buffer to write the ASCII NUL terminated line to
+ * @param length, size of 'output'
+ * @return as 'snprintf' */
+int embed_trace_format(embed_t *h, const embed_trace_record_t *r, char *output, size_t length);
+
+/**@brief Get a copy of the counters kept whilst running, which are only kept
+ * if the 'stats' option points to some counters, and if the library was
+ * compiled with 'EMBED_STATS' not set to zero. The image can read them as
+ * well, with ALU operation 31. Zero the counters to start counting again.
+ * @param h, virtual machine to get the counters of
+ * @param out, copy of the counters, zeroed if none are kept
+ * @return zero on success, negative if there are no counters */
+int embed_stats(embed_t *h, embed_stats_t *out);
+
+/**@brief Find the word that the code at 'pc' belongs to, using the index
+ * set in the options structure with 'embed_opt_set' (which is brought up to
+ * date first). Code in words without a header, which the metacompiler makes
+ * many of, is attributed to the word with a header defined before it, unless
+ * the index came from a name table, which names every word.
+ * @param h,      virtual machine with an eForth image
+ * @param pc,     cell address of the code
+ * @param name,   buffer to write the name of the word to, NUL terminated
+ * @param length, length of 'name', the name is truncated if it does not fit
+ * @return offset in cells of 'pc' from the start of the word, negative if
+ * there is no index or 'pc' comes before every word in it */
+int embed_symbolize(embed_t *h, cell_t pc, char *name, size_t length);
+
 /**@brief This array contains the default virtual machine image, generated from
  * 'embed-1.blk', which is included in the library. It contains a fully working
  * eForth image */
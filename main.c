@@ -1,25 +1,34 @@
+#define _POSIX_C_SOURCE 200809L
 #include "embed.h"
 #include "util.h"
 #include <assert.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
+#define TRACE_RECORDS (1uL << 20) /**< instructions kept in a binary trace, a power of two */
+
 #ifdef _WIN32 /* Making standard input streams on Windows binary */
 #include <windows.h>
 #include <io.h>
 #include <fcntl.h>
 extern int _fileno(FILE *stream);
 static void binary(FILE *f) { _setmode(_fileno(f), _O_BINARY); }
+static unsigned long process(void) { return GetCurrentProcessId(); }
 #else
+#include <unistd.h>
 static inline void binary(FILE *f) { UNUSED(f); }
+static unsigned long process(void) { return getpid(); }
 #endif
 
 static int load_default_or_file(embed_t *h, const char *file) {
 	assert(h);
-	if (!file)
-		return embed_load_buffer(h, embed_default_block, embed_default_block_size);
-	return embed_load(h, file);
+	const int r = !file ?
+		embed_load_buffer(h, embed_default_block, embed_default_block_size) :
+		embed_load(h, file);
+	return r;
 }
 
 static int run(embed_t *h, embed_vm_option_e opt, bool load, FILE *in, FILE *out, const char *iblk, const char *oblk) {
@@ -38,8 +47,327 @@ static int run_file(embed_t *h, embed_vm_option_e opt, bool load, char *in_file,
 	return r;
 }
 
+static void print_stats(embed_t *h, FILE *out) {
+	assert(h && out);
+	static const char *names[] = {
+		"literals", "alus", "calls", "0branches", "0branches-taken", "branches",
+	};
+	static const char *callbacks[] = {
+		"gets", "puts", "saves", "callbacks", "yields", "bytes-in", "bytes-out",
+	};
+	embed_stats_t s;
+	if (embed_stats(h, &s) < 0)
+		return;
+	for (size_t i = 0; i < sizeof (names) / sizeof (names[0]); i++)
+		fprintf(out, "%-16s %lu\n", names[i], s.count[EMBED_STAT_LITERAL + i]);
+	for (size_t i = 0; i < sizeof (callbacks) / sizeof (callbacks[0]); i++)
+		fprintf(out, "%-16s %lu\n", callbacks[i], s.count[EMBED_STAT_GET + i]);
+	for (size_t i = 0; i < 32; i++)
+		fprintf(out, "alu-op-%02u        %lu\n", (unsigned)i, s.count[EMBED_STAT_ALU_OP + i]);
+}
+
+static uint32_t fnv1a(uint32_t h, const uint8_t *b, size_t l) {
+	assert(b);
+	for (size_t i = 0; i < l; i++)
+		h = (h ^ b[i]) * 16777619ul;
+	return h;
+}
+
+/* The cache key covers the loaded image and the contents of all script files,
+ * the resulting image is stored as 'dir/embed-XXXXXXXX.blk'. The virtual
+ * machine reads each file through the 'get' callback and has no way of
+ * opening any others, there is no 'include', so that is all of its input. */
+static int cache_name(embed_t *h, char *name, size_t length, const char *dir, int argc, char **argv) {
+	assert(h && name && dir && argv);
+	uint32_t hash = 2166136261ul;
+	for (size_t i = 0; i < embed_cells(h); i++) {
+		const cell_t c = embed_core_get(h)[i];
+		const uint8_t b[2] = { c & 0xFF, c >> 8 };
+		hash = fnv1a(hash, b, sizeof b);
+	}
+	for (int i = 0; i < argc; i++) {
+		FILE *in = embed_fopen_or_die(argv[i], "rb");
+		uint8_t b[512];
+		size_t r = 0;
+		while ((r = fread(b, 1, sizeof b, in)))
+			hash = fnv1a(hash, b, r);
+		fclose(in);
+		hash = fnv1a(hash, (const uint8_t*)"", 1); /* file separator */
+	}
+	const int r = snprintf(name, length, "%s/embed-%08lx.blk", dir, (unsigned long)hash);
+	return r < 0 || (size_t)r >= length ? -1 : 0;
+}
+
+/* A cache entry is written to a temporary file, named after this process,
+ * and renamed into place, so a run that is interrupted, or another run with
+ * the same key, never sees part of an image. */
+static int cache_save(embed_t *h, const char *name) {
+	assert(h && name);
+	char temporary[600];
+	const int r = snprintf(temporary, sizeof temporary, "%s.%lu.tmp", name, process());
+	if (r < 0 || (size_t)r >= sizeof temporary)
+		return -1;
+	if (embed_save(h, temporary) < 0) {
+		remove(temporary);
+		return -1;
+	}
+	if (rename(temporary, name) < 0) { /* Windows does not replace 'name' */
+		remove(name);
+		if (rename(temporary, name) < 0) {
+			remove(temporary);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* On a cache hit the files are not run, so the image is saved to the '-o'
+ * file by running 'save' in it, which writes what the files would have. */
+static int cache_saved = 0;
+
+static int cache_save_cb(const embed_t *h, const void *name, const size_t start, const size_t length) {
+	const int r = embed_save_cb(h, name, start, length);
+	cache_saved = r < 0 ? r : 1;
+	return r;
+}
+
+static int cache_save_output(embed_t *h, embed_vm_option_e opt, const char *oblk) {
+	assert(h && oblk);
+	const char *input = "save\n";
+	embed_opt_t o = embed_opt_default_hosted();
+	o.get = embed_sgetc_cb, o.in = &input, o.save = cache_save_cb, o.name = oblk;
+	o.options = opt | EMBED_VM_QUITE_ON;
+	embed_opt_set(h, &o);
+	embed_reset(h);
+	cache_saved = 0;
+	const int r = embed_vm(h);
+	return r < 0 || cache_saved <= 0 ? -1 : 0;
+}
+
+#ifndef _WIN32
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "pool.h"
+
+#define SERVER_WORKERS      (4)   /**< default number of worker processes accepting connections */
+#define SERVER_IDLE_SECONDS (300) /**< a client that sends nothing for this long is dropped */
+#define SERVER_CPU_SECONDS  (60)  /**< a client whose image runs for this much CPU time is dropped */
+#define SERVER_BUFFER       (512) /**< bytes buffered in each direction */
+#define SCRIPT_OUTPUT       (4096) /**< initial size of the output buffer of a script */
+
+typedef struct {
+	int fd;
+	size_t in_used, in_at, out_used;
+	uint8_t in[SERVER_BUFFER], out[SERVER_BUFFER];
+} connection_t;
+
+static volatile sig_atomic_t server_stop = 0, server_spent = 0;
+static void server_signal(int sig) { UNUSED(sig); server_stop = 1; }
+static void server_cpu(int sig) { UNUSED(sig); server_spent = 1; }
+
+static int connection_flush(connection_t *c) {
+	for (size_t i = 0; i < c->out_used; ) {
+		const ssize_t r = write(c->fd, c->out + i, c->out_used - i);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		i += r;
+	}
+	c->out_used = 0;
+	return 0;
+}
+
+static int connection_putc(int ch, void *file) {
+	connection_t *c = file;
+	c->out[c->out_used++] = ch;
+	if (c->out_used == sizeof c->out && connection_flush(c) < 0)
+		return EOF;
+	return ch;
+}
+
+/* Output is only sent when the virtual machine wants more input, or when its
+ * buffer fills up, so a line of output is one write and not one per byte. */
+static int connection_getc(void *file, int *no_data) {
+	connection_t *c = file;
+	*no_data = 0;
+	if (c->in_at == c->in_used) {
+		struct pollfd p = { .fd = c->fd, .events = POLLIN };
+		if (connection_flush(c) < 0 || poll(&p, 1, SERVER_IDLE_SECONDS * 1000) <= 0)
+			return EOF;
+		const ssize_t r = read(c->fd, c->in, sizeof c->in);
+		if (r <= 0)
+			return EOF;
+		c->in_used = r, c->in_at = 0;
+	}
+	return c->in[c->in_at++];
+}
+
+/* Each client gets a copy of the booted image, in a worker whose memory is
+ * shared with the server process until it is written to. The idle timeout
+ * only applies whilst the image waits for input, so the image is also given
+ * a budget of CPU time, measured by a virtual timer which does not run whilst
+ * the worker waits, and is preempted and dropped when it is spent. */
+static void server_worker(embed_t *h, const cell_t *booted, int listener) {
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGVTALRM, server_cpu);
+	const struct itimerval budget = { .it_value = { .tv_sec = SERVER_CPU_SECONDS } }, off = { .it_value = { .tv_sec = 0 } };
+	for (;;) {
+		connection_t c = { .fd = accept(listener, NULL, NULL) };
+		if (c.fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			_exit(EXIT_FAILURE);
+		}
+		memcpy(h->m, booted, EMBED_CORE_SIZE * sizeof(cell_t));
+		embed_opt_t *o = embed_opt_get(h);
+		o->get = connection_getc, o->in  = &c;
+		o->put = connection_putc, o->out = &c;
+		o->preempt = &server_spent;
+		server_spent = 0;
+		setitimer(ITIMER_VIRTUAL, &budget, NULL);
+		embed_vm(h); /* returns 'EMBED_PREEMPTED' when the budget is spent */
+		setitimer(ITIMER_VIRTUAL, &off, NULL);
+		connection_flush(&c);
+		close(c.fd);
+	}
+}
+
+static int serve(embed_t *h, embed_vm_option_e opt, const char *path, const char *oblk, size_t count) {
+	assert(h && path && count);
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof addr.sun_path)
+		embed_fatal("embed: socket path too long (path = %s)", path);
+	strcpy(addr.sun_path, path);
+
+	embed_opt_t o = embed_opt_default_hosted(); /* boot the image once, with no input */
+	o.get = embed_ngetc_cb, o.put = embed_nputc_cb, o.options = opt, o.name = oblk;
+	embed_opt_set(h, &o);
+	if (embed_vm(h) < 0)
+		embed_fatal("embed: image failed to boot");
+	cell_t *booted = embed_alloc(EMBED_CORE_SIZE * sizeof(cell_t));
+	if (!booted)
+		embed_fatal("embed: allocate failed");
+	memcpy(booted, h->m, EMBED_CORE_SIZE * sizeof(cell_t));
+
+	const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(path);
+	if (listener < 0 || bind(listener, (struct sockaddr*)&addr, sizeof addr) < 0 || listen(listener, 64) < 0)
+		embed_fatal("embed: could not listen on %s: %s", path, strerror(errno));
+
+	struct sigaction sa = { .sa_handler = server_signal }; /* no SA_RESTART, so 'wait' is interrupted */
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	pid_t *workers = embed_alloc(count * sizeof *workers);
+	if (!workers)
+		embed_fatal("embed: allocate failed");
+	memset(workers, 0, count * sizeof *workers);
+	while (!server_stop) {
+		for (size_t i = 0; i < count; i++) {
+			if (workers[i])
+				continue;
+			if ((workers[i] = fork()) == 0)
+				server_worker(h, booted, listener);
+			if (workers[i] < 0)
+				embed_fatal("embed: fork failed: %s", strerror(errno));
+		}
+		const pid_t dead = wait(NULL); /* restart workers that die */
+		for (size_t i = 0; i < count; i++)
+			if (workers[i] == dead)
+				workers[i] = 0;
+	}
+	for (size_t i = 0; i < count; i++)
+		if (workers[i] > 0)
+			kill(workers[i], SIGTERM);
+	while (wait(NULL) > 0)
+		;
+	close(listener);
+	unlink(path);
+	free(workers);
+	free(booted);
+	return 0;
+}
+
+static char *slurp(const char *name) {
+	assert(name);
+	FILE *in = embed_fopen_or_die(name, "rb");
+	size_t length = 0, max = 4096;
+	char *b = embed_alloc(max);
+	for (size_t r = 0; b && (r = fread(b + length, 1, max - length - 1, in)); ) {
+		length += r;
+		if (length + 1 == max) {
+			char *n = realloc(b, max *= 2);
+			if (!n)
+				free(b);
+			b = n;
+		}
+	}
+	fclose(in);
+	if (!b)
+		embed_fatal("embed: allocate failed (file = %s)", name);
+	b[length] = 0;
+	return b;
+}
+
+/* Each script is run by a worker pool on its own copy of the loaded image,
+ * not one after another in the same virtual machine, into an output buffer
+ * that the pool grows as it fills up. */
+static int run_scripts(embed_t *h, embed_vm_option_e opt, size_t workers, int argc, char **argv, FILE *out) {
+	assert(h && argv && out);
+	const size_t cells = embed_cells(h);
+	uint8_t *image = embed_alloc(cells * sizeof(cell_t));
+	embed_job_t *jobs = embed_alloc(argc * sizeof *jobs);
+	embed_pool_t *p = embed_pool_new(workers, 16);
+	if (!image || !jobs || !p)
+		embed_fatal("embed: allocate failed");
+	for (size_t i = 0; i < cells; i++) {
+		const cell_t c = embed_core_get(h)[i];
+		image[i * 2 + 0] = c & 0xFF;
+		image[i * 2 + 1] = c >> 8;
+	}
+	memset(jobs, 0, argc * sizeof *jobs);
+	for (int i = 0; i < argc; i++) {
+		jobs[i].image   = image, jobs[i].image_length = cells * sizeof(cell_t);
+		jobs[i].input   = slurp(argv[i]);
+		jobs[i].options = opt | EMBED_VM_QUITE_ON;
+		jobs[i].output  = embed_alloc(SCRIPT_OUTPUT), jobs[i].output_max = SCRIPT_OUTPUT;
+		jobs[i].output_grow = 1;
+		if (!(jobs[i].output))
+			embed_fatal("embed: allocate failed");
+		if (embed_pool_submit(p, &jobs[i]) < 0)
+			embed_fatal("embed: submit failed");
+	}
+	embed_pool_wait(p);
+	int r = 0;
+	for (int i = 0; i < argc; i++) {
+		const size_t length = jobs[i].output_length < jobs[i].output_max ? jobs[i].output_length : jobs[i].output_max;
+		fwrite(jobs[i].output, 1, length, out);
+		if (length < jobs[i].output_length)
+			embed_warning("embed: out of memory, output lost (file = %s)", argv[i]);
+		if (jobs[i].result < 0 && r == 0)
+			r = jobs[i].result;
+		free(jobs[i].output);
+		free((char*)jobs[i].input);
+	}
+	embed_pool_free(p);
+	free(jobs);
+	free(image);
+	return r;
+}
+#endif
+
 static const char *help ="\
-usage: ./embed [-hqtTa-] -i in.blk -o out.blk file.fth...\n\n\
+usage: ./embed [-hqtTaCzsux-] -i in.blk -o out.blk -c dir -S path -j N -B file.trc file.fth...\n\n\
 Program: Embed Virtual Machine and eForth Image\n\
 Author:  Richard James Howe\n\
 License: MIT\n\
@@ -49,57 +377,160 @@ Options:\n\
 \t-o out.blk  set save location to 'out.blk'\n\
 \t-h          display this help message and die\n\
 \t-q          quite mode on\n\
-\t-t          turn tracing on\n\
+\t-t          turn tracing on, naming the words being executed\n\
+\t-B file.trc trace the last instructions run into 'file.trc', see 'tdecode'\n\
+\t-x          count instructions run, printing the counts to stderr at exit\n\
 \t-I file.fth set input file\n\
 \t-O file.txt set output file\n\
 \t-T          run built in self tests\n\
+\t-z          compress images that are saved\n\
+\t-s          save images sparsely, only storing non-zero extents\n\
+\t-u          run unchecked, registers wrap around memory instead of\n\
+\t            stopping the virtual machine when they are out of bounds\n\
 \t-a          read from stdin/file specified by '-I' after files\n\
+\t-c dir      cache the image produced by the file list in 'dir'\n\
+\t-C          invalidate the cache entry for this image and file list,\n\
+\t            only with '-c'\n\
+\t-S path     serve the image on the Unix domain socket 'path'\n\
+\t-j N        run each file on its own copy of the image, N at a time,\n\
+\t            or use N worker processes with '-S'\n\
 \t--          stop processing command arguments\n\
 \tfile.fth    read from 'file.fth'\n\n\
 If no input Forth file is given standard input is read from. If no input\n\
 block is given a built in block containing an eForth interpreter is\n\
-used.\n\n\
+used. Input blocks may be raw, compressed or sparse images.\n\n\
+With '-c' the image resulting from running the file list is saved in the\n\
+cache directory, keyed on a hash of the input image and the contents of the\n\
+files, later runs load that image instead of interpreting the files again.\n\
+The image is then written to the file given with '-o', if any, and the run\n\
+carries on as it would have after the files, reading stdin with '-a'.\n\
+Output produced whilst interpreting the files is not replayed from the cache.\n\
+The files can only read themselves, the host gives images no way of opening\n\
+other files, so nothing else needs to be part of the key.\n\n\
+With '-S' the image, after running any files, is booted once and served on a\n\
+Unix domain socket by a few worker processes forked from it. Each client is\n\
+given a fresh copy of the booted image, and is dropped when it quits or\n\
+sends nothing for five minutes or has used a minute of CPU time.\n\n\
+With '-j' each file is run on a fresh copy of the input image by one of N\n\
+threads, rather than one after another in the same virtual machine. The\n\
+output of each file is written out in order once all of them have finished,\n\
+the exit status is that of the first file to fail. Files run this way cannot\n\
+save images, and '-c' cannot be used with '-j'.\n\n\
 ";
 
 int main(int argc, char **argv) {
 	embed_getopt_t go = { .init = 0, .error = 1 };
 	embed_vm_option_e option = 0;
-	const char *oblk = NULL, *iblk = NULL;
+	const char *oblk = NULL, *iblk = NULL, *cache = NULL, *server = NULL, *traced = NULL;
+	char cached[512] = { 0 };
 	FILE *in = stdin, *out = stdout;
-	bool ran = false, terminal = false;
-	int r = 0, ch;
+	bool ran = false, terminal = false, invalidate = false, counted = false;
+	size_t workers = 0;
+	int r = 0, ch, first = 0;
 	binary(stdin);
 	binary(stdout);
 	binary(stderr);
 
 	static cell_t m[EMBED_CORE_SIZE] = { 0 };
 	static embed_t h = { .m = m };
+	static embed_symbol_t symbols[2048];
+	static embed_symbols_t index = { .symbols = symbols, .max = sizeof (symbols) / sizeof (symbols[0]) };
 	if (embed_default_hosted(&h) < 0)
 		embed_fatal("embed: load failed\n");
 
-	while ((ch = embed_getopt(&go, argc, argv, "hqtTi:o:I:O:a")) != -1) {
+	while ((ch = embed_getopt(&go, argc, argv, "hqtTi:o:I:O:ac:CzsuxB:"
+#ifndef _WIN32
+			"S:j:"
+#endif
+			)) != -1) {
 		switch (ch) {
 		case 'h': fputs(help, stdout); return 0;
 		case 'i': iblk = go.arg; break;
 		case 'o': oblk = go.arg; break;
 		case 'q': option |= EMBED_VM_QUITE_ON; break;
-		case 't': option |= EMBED_VM_TRACE_ON; break;
+		case 't': option |= EMBED_VM_TRACE_ON; h.o.symbols = &index; break;
+		case 'B': option |= EMBED_VM_TRACE_ON; traced = go.arg; break;
 		case 'O': if (out != stdout) { fclose(out); } out = embed_fopen_or_die(go.arg, "wb"); break;
 		case 'I': if (in  != stdin)  { fclose(in); }  in  = embed_fopen_or_die(go.arg, "rb"); break;
 		case 'T': return embed_tests();
 		case 'a': terminal = true; break;
+		case 'c': cache = go.arg; break;
+		case 'C': invalidate = true; break;
+		case 'z': option |= EMBED_VM_COMPRESS; break;
+		case 's': option |= EMBED_VM_SPARSE; break;
+		case 'u': option |= EMBED_VM_UNCHECKED; break;
+		case 'x': counted = true; break;
+		case 'S': server = go.arg; break;
+		case 'j': workers = strtoul(go.arg, NULL, 0); if (!workers) { fputs(help, stdout); return 1; } break;
 		default: fputs(help, stdout); return 1;
 		}
 	}
 
-	for (int i = go.index; i < argc; i++) {
+	embed_trace_t trace = { .records = NULL, .length = TRACE_RECORDS };
+	if (traced) {
+		if (!(trace.records = embed_alloc(TRACE_RECORDS * sizeof *trace.records)))
+			embed_fatal("embed: allocate failed");
+		h.o.trace = &trace;
+	}
+	static embed_stats_t stats;
+	if (counted)
+		h.o.stats = &stats;
+
+	if (invalidate && !cache)
+		embed_fatal("embed: '-C' can only be used with '-c'");
+
+	first = go.index;
+#ifndef _WIN32
+	if (workers && first < argc && !server) { /* with '-S' the files are run first, as usual */
+		if (cache)
+			embed_fatal("embed: '-c' cannot be used with '-j'");
+		if (load_default_or_file(&h, iblk) < 0)
+			embed_fatal("embed: load failed (input = %s)", iblk ? iblk : "(null)");
+		r = run_scripts(&h, option, workers, argc - first, argv + first, out);
+		first = argc, ran = true;
+	}
+#endif
+	if (cache && first < argc) {
+		if (load_default_or_file(&h, iblk) < 0)
+			embed_fatal("embed: load failed (input = %s)", iblk ? iblk : "(null)");
+		if (cache_name(&h, cached, sizeof cached, cache, argc - go.index, argv + go.index) < 0)
+			embed_fatal("embed: cache file name too long (cache = %s)", cache);
+		if (!invalidate && embed_load(&h, cached) >= 0) {
+			first = argc; /* cache hit, skip the file list */
+			if (oblk && cache_save_output(&h, option, oblk) < 0) {
+				embed_warning("embed: could not write image (file = %s)", oblk);
+				r = -1;
+			}
+		}
+		ran = true;
+	}
+
+	for (int i = first; i < argc; i++) {
 		if ((r = run_file(&h, option | EMBED_VM_QUITE_ON, !ran, argv[i], out, iblk, oblk)) < 0)
 			break;
 		ran = true;
 	}
 
+	if (cached[0] && first < argc && r >= 0) {
+		embed_opt_get(&h)->options = option; /* save in the selected format */
+		if (cache_save(&h, cached) < 0)
+			embed_warning("embed: could not write cache (file = %s)", cached);
+	}
+
+#ifndef _WIN32
+	if (server) {
+		if (!ran && load_default_or_file(&h, iblk) < 0)
+			embed_fatal("embed: load failed (input = %s)", iblk ? iblk : "(null)");
+		return r < 0 ? r : serve(&h, option, server, oblk, workers ? workers : SERVER_WORKERS);
+	}
+#endif
 	if (go.index == argc || terminal)
 		r = run(&h, option, !ran, in, out, iblk, oblk);
+	if (traced && embed_trace_save(&trace, traced) < 0)
+		embed_warning("embed: could not write trace (file = %s)", traced);
+	if (counted)
+		print_stats(&h, stderr);
+	free(trace.records);
 	fclose(in);
 	fclose(out);
 	return r;
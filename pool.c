@@ -0,0 +1,593 @@
+#define _POSIX_C_SOURCE 200809L
+#include "pool.h"
+#include "util.h"
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define EMBED_CORE_BYTES (EMBED_CORE_SIZE * sizeof(cell_t))
+
+typedef struct {
+	pthread_mutex_t lock;  /**< guards the fields below */
+	embed_job_t **jobs;    /**< ring buffer of 'depth' jobs */
+	size_t top, count;     /**< oldest job, and number of jobs waiting */
+} embed_deque_t; /**< Double ended queue, the owner uses the bottom, thieves the top */
+
+typedef struct {
+	embed_pool_t *pool;
+	size_t id;              /**< index of this worker in the pool */
+	pthread_t thread;
+	embed_t *h;             /**< virtual machine reused for every job */
+	uint64_t image_hash;    /**< hash of the last image booted... */
+	size_t image_length;    /**< ...its length... */
+	embed_vm_option_e options; /**< ...the options it was booted with... */
+	cell_t *snapshot;       /**< ...and a copy of the core once it had booted */
+	embed_deque_t deque;
+} embed_worker_t; /**< A worker thread */
+
+struct embed_channel_t {
+	atomic_size_t head,  /**< bytes read, only changed by the reader */
+		      tail;  /**< bytes written, only changed by the writer */
+	atomic_int closed,   /**< set by the writer when it is done */
+		   hung_up;  /**< set by the reader when it is done */
+	unsigned long timeout; /**< microseconds the reader waits for data */
+	size_t mask;         /**< size of 'buf' less one, the size is a power of two */
+	uint8_t *buf;
+}; /**< Single writer, single reader, ring buffer */
+
+typedef struct {
+	size_t length;
+	char line[EMBED_LOG_LINE];
+} embed_log_line_t;
+
+typedef struct embed_log_ring_t {
+	atomic_size_t head,            /**< lines written out, only changed by the log thread */
+		      tail;            /**< lines queued, only changed by the owning thread */
+	struct embed_log_ring_t *next; /**< next ring in the log, set before it is added */
+	pthread_t owner;               /**< thread that writes to this ring */
+	embed_log_line_t *lines;
+} embed_log_ring_t; /**< Single writer, single reader, ring buffer of lines */
+
+struct embed_log_t {
+	FILE *out;
+	size_t mask;         /**< lines in each ring less one */
+	unsigned long id;    /**< unique for every log made, see 'embed_log_local' */
+	_Atomic(embed_log_ring_t*) rings; /**< one for each thread that has logged */
+	atomic_ulong written, dropped;
+	atomic_int stop;
+	pthread_t thread;
+};
+
+struct embed_pool_t {
+	pthread_mutex_t lock;   /**< guards the fields below */
+	pthread_cond_t work,    /**< signalled when a job is queued, or on stopping */
+		       room,    /**< signalled when a job is taken off a queue */
+		       idle;    /**< signalled when there are no jobs left to finish */
+	size_t queued,          /**< jobs waiting in queues */
+	       pending,         /**< jobs submitted but not yet finished */
+	       next;            /**< queue the next job goes to */
+	int stop;               /**< set when the workers are to exit */
+	size_t workers, depth, started;
+	embed_worker_t *worker;
+};
+
+static int embed_deque_push(embed_deque_t *d, size_t depth, embed_job_t *job) {
+	int r = -1;
+	pthread_mutex_lock(&d->lock);
+	if (d->count < depth) {
+		d->jobs[(d->top + d->count++) % depth] = job;
+		r = 0;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return r;
+}
+
+static embed_job_t *embed_deque_pop(embed_deque_t *d, size_t depth) { /* newest */
+	embed_job_t *job = NULL;
+	pthread_mutex_lock(&d->lock);
+	if (d->count)
+		job = d->jobs[(d->top + --d->count) % depth];
+	pthread_mutex_unlock(&d->lock);
+	return job;
+}
+
+static embed_job_t *embed_deque_steal(embed_deque_t *d, size_t depth) { /* oldest */
+	embed_job_t *job = NULL;
+	pthread_mutex_lock(&d->lock);
+	if (d->count) {
+		job = d->jobs[d->top];
+		d->top = (d->top + 1) % depth;
+		d->count--;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return job;
+}
+
+static int embed_pool_putc(int ch, void *file) {
+	embed_job_t *job = file;
+	if (job->output_grow && job->output_length == job->output_max) {
+		const size_t max = job->output_max ? job->output_max * 2 : 256;
+		char *output = max > job->output_max ? realloc(job->output, max) : NULL;
+		if (output) /* if not, output is lost as it is when not growing */
+			job->output = output, job->output_max = max;
+	}
+	if (job->output && job->output_length < job->output_max)
+		job->output[job->output_length] = ch;
+	job->output_length++;
+	return ch;
+}
+
+/* Booting an image is the slowest part of running a small job, so the image
+ * is booted once with no input and the core copied when it yields for more,
+ * each job then starts from that copy and carries on where it left off. The
+ * copy is keyed on a hash of the image's contents and not on its address, a
+ * caller may well reuse one buffer for different images, and hashing is far
+ * cheaper than booting. */
+static uint64_t embed_pool_hash(const uint8_t *image, const size_t length) {
+	uint64_t hash = 0xcbf29ce484222325ull; /* FNV-1a */
+	for (size_t i = 0; i < length; i++)
+		hash = (hash ^ image[i]) * 0x100000001b3ull;
+	return hash;
+}
+
+static int embed_pool_boot(embed_worker_t *w, const uint8_t *image, const size_t length, const uint64_t hash, const embed_vm_option_e options) {
+	embed_t *h = w->h;
+	w->image_length = 0;
+	memset(h->m, 0, EMBED_CORE_BYTES);
+	embed_opt_t o = embed_opt_default();
+	embed_opt_set(h, &o);
+	int r = embed_load_buffer(h, image, length);
+	if (r < 0)
+		return r;
+	o.options = options;
+	embed_opt_set(h, &o);
+	if ((r = embed_vm(h)) < 0)
+		return r;
+	memcpy(w->snapshot, h->m, EMBED_CORE_BYTES);
+	w->image_hash = hash, w->image_length = length, w->options = options;
+	return 0;
+}
+
+static void embed_pool_run(embed_worker_t *w, embed_job_t *job) {
+	assert(w && job);
+	embed_t *h = w->h;
+	const uint8_t *image = job->image ? job->image : embed_default_block;
+	const size_t length  = job->image ? job->image_length : embed_default_block_size;
+	const uint64_t hash  = embed_pool_hash(image, length);
+	job->output_length = 0;
+	if (!w->image_length || hash != w->image_hash || length != w->image_length || job->options != w->options) {
+		if ((job->result = embed_pool_boot(w, image, length, hash, job->options)) < 0)
+			return;
+	} else {
+		memcpy(h->m, w->snapshot, EMBED_CORE_BYTES);
+	}
+	const char *input = job->input ? job->input : "";
+	embed_opt_t o = embed_opt_default();
+	o.get     = embed_sgetc_cb,   o.in  = &input;
+	o.put     = embed_pool_putc,  o.out = job;
+	o.options = job->options;
+	embed_opt_set(h, &o);
+	job->result = embed_vm(h);
+}
+
+static embed_job_t *embed_pool_take(embed_worker_t *w) {
+	embed_pool_t *p = w->pool;
+	embed_job_t *job = embed_deque_pop(&w->deque, p->depth);
+	for (size_t i = 1; !job && i < p->workers; i++)
+		job = embed_deque_steal(&p->worker[(w->id + i) % p->workers].deque, p->depth);
+	return job;
+}
+
+static void *embed_pool_worker(void *param) {
+	embed_worker_t *w = param;
+	embed_pool_t *p = w->pool;
+	for (;;) {
+		pthread_mutex_lock(&p->lock);
+		while (!p->queued && !p->stop)
+			pthread_cond_wait(&p->work, &p->lock);
+		if (!p->queued) {
+			pthread_mutex_unlock(&p->lock);
+			return NULL;
+		}
+		pthread_mutex_unlock(&p->lock);
+		embed_job_t *job = embed_pool_take(w);
+		if (!job) /* another worker got there first */
+			continue;
+		pthread_mutex_lock(&p->lock);
+		p->queued--;
+		pthread_cond_signal(&p->room);
+		pthread_mutex_unlock(&p->lock);
+
+		embed_pool_run(w, job);
+		if (job->done)
+			job->done(job);
+
+		pthread_mutex_lock(&p->lock);
+		if (!--p->pending)
+			pthread_cond_broadcast(&p->idle);
+		pthread_mutex_unlock(&p->lock);
+	}
+}
+
+int embed_pool_submit(embed_pool_t *p, embed_job_t *job) {
+	assert(p && job);
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		if (p->stop) {
+			pthread_mutex_unlock(&p->lock);
+			return -1;
+		}
+		size_t i = 0;
+		for (; i < p->workers; i++)
+			if (embed_deque_push(&p->worker[(p->next + i) % p->workers].deque, p->depth, job) == 0)
+				break;
+		if (i < p->workers) {
+			p->next = (p->next + i + 1) % p->workers;
+			break;
+		}
+		pthread_cond_wait(&p->room, &p->lock);
+	}
+	p->queued++;
+	p->pending++;
+	pthread_cond_signal(&p->work);
+	pthread_mutex_unlock(&p->lock);
+	return 0;
+}
+
+void embed_pool_wait(embed_pool_t *p) {
+	assert(p);
+	pthread_mutex_lock(&p->lock);
+	while (p->pending)
+		pthread_cond_wait(&p->idle, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+}
+
+void embed_pool_free(embed_pool_t *p) {
+	if (!p)
+		return;
+	embed_pool_wait(p);
+	pthread_mutex_lock(&p->lock);
+	p->stop = 1;
+	pthread_cond_broadcast(&p->work);
+	pthread_cond_broadcast(&p->room);
+	pthread_mutex_unlock(&p->lock);
+	for (size_t i = 0; i < p->started; i++)
+		pthread_join(p->worker[i].thread, NULL);
+	for (size_t i = 0; i < p->workers; i++) {
+		embed_worker_t *w = &p->worker[i];
+		embed_free(w->h);
+		free(w->snapshot);
+		free(w->deque.jobs);
+		pthread_mutex_destroy(&w->deque.lock);
+	}
+	pthread_cond_destroy(&p->work);
+	pthread_cond_destroy(&p->room);
+	pthread_cond_destroy(&p->idle);
+	pthread_mutex_destroy(&p->lock);
+	free(p->worker);
+	free(p);
+}
+
+embed_pool_t *embed_pool_new(size_t workers, size_t depth) {
+	if (!workers || !depth)
+		return NULL;
+	embed_pool_t *p = embed_alloc(sizeof *p);
+	if (!p)
+		return NULL;
+	p->workers = workers, p->depth = depth;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->work, NULL);
+	pthread_cond_init(&p->room, NULL);
+	pthread_cond_init(&p->idle, NULL);
+	if (!(p->worker = embed_alloc(workers * sizeof *p->worker))) {
+		p->workers = 0;
+		goto fail;
+	}
+	for (size_t i = 0; i < workers; i++)
+		pthread_mutex_init(&p->worker[i].deque.lock, NULL);
+	for (size_t i = 0; i < workers; i++) {
+		embed_worker_t *w = &p->worker[i];
+		w->pool = p, w->id = i;
+		w->h        = embed_new();
+		w->snapshot = embed_alloc(EMBED_CORE_BYTES);
+		w->deque.jobs = embed_alloc(depth * sizeof *w->deque.jobs);
+		if (!(w->h) || !(w->snapshot) || !(w->deque.jobs))
+			goto fail;
+	}
+	for (; p->started < workers; p->started++)
+		if (pthread_create(&p->worker[p->started].thread, NULL, embed_pool_worker, &p->worker[p->started]))
+			goto fail;
+	return p;
+fail:
+	embed_pool_free(p);
+	return NULL;
+}
+
+embed_channel_t *embed_channel_new(size_t size) {
+	size_t s = 1;
+	while (s < size)
+		if (!(s <<= 1))
+			return NULL;
+	embed_channel_t *c = embed_alloc(sizeof *c);
+	if (!c)
+		return NULL;
+	if (!(c->buf = embed_alloc(s))) {
+		free(c);
+		return NULL;
+	}
+	atomic_init(&c->head, 0);
+	atomic_init(&c->tail, 0);
+	atomic_init(&c->closed, 0);
+	atomic_init(&c->hung_up, 0);
+	c->mask = s - 1;
+	c->timeout = 0;
+	return c;
+}
+
+void embed_channel_free(embed_channel_t *c) {
+	if (!c)
+		return;
+	free(c->buf);
+	free(c);
+}
+
+size_t embed_channel_write(embed_channel_t *c, const void *buf, size_t length) {
+	assert(c && buf);
+	const size_t tail = atomic_load_explicit(&c->tail, memory_order_relaxed);
+	const size_t head = atomic_load_explicit(&c->head, memory_order_acquire);
+	const size_t room = c->mask + 1 - (tail - head);
+	const size_t n = length < room ? length : room;
+	const size_t at = tail & c->mask, first = n < (c->mask + 1 - at) ? n : (c->mask + 1 - at);
+	memcpy(c->buf + at, buf, first);
+	memcpy(c->buf, (const uint8_t*)buf + first, n - first);
+	atomic_store_explicit(&c->tail, tail + n, memory_order_release);
+	return n;
+}
+
+size_t embed_channel_read(embed_channel_t *c, void *buf, size_t length) {
+	assert(c && buf);
+	const size_t head = atomic_load_explicit(&c->head, memory_order_relaxed);
+	const size_t tail = atomic_load_explicit(&c->tail, memory_order_acquire);
+	const size_t n = length < (tail - head) ? length : (tail - head);
+	const size_t at = head & c->mask, first = n < (c->mask + 1 - at) ? n : (c->mask + 1 - at);
+	memcpy(buf, c->buf + at, first);
+	memcpy((uint8_t*)buf + first, c->buf, n - first);
+	atomic_store_explicit(&c->head, head + n, memory_order_release);
+	return n;
+}
+
+void embed_channel_close(embed_channel_t *c) {
+	assert(c);
+	atomic_store_explicit(&c->closed, 1, memory_order_release);
+}
+
+int embed_channel_eof(embed_channel_t *c) {
+	assert(c);
+	if (!atomic_load_explicit(&c->closed, memory_order_acquire))
+		return 0;
+	return atomic_load_explicit(&c->head, memory_order_relaxed) == atomic_load_explicit(&c->tail, memory_order_acquire);
+}
+
+int embed_channel_full_cb(void *channel) {
+	embed_channel_t *c = channel;
+	assert(c);
+	return atomic_load_explicit(&c->tail, memory_order_relaxed) - atomic_load_explicit(&c->head, memory_order_acquire) > c->mask;
+}
+
+void embed_channel_hangup(embed_channel_t *c) {
+	assert(c);
+	atomic_store_explicit(&c->hung_up, 1, memory_order_release);
+}
+
+/* The other end of a channel is usually quick to catch up, so a thread
+ * waiting on it yields for a few rounds and then sleeps, for twice as long
+ * each time up to about a millisecond, so that it does not keep a processor
+ * busy if the other end takes its time. */
+static void embed_channel_backoff(unsigned *waited) {
+	const unsigned spins = 64, most = 10;
+	if ((*waited)++ < spins) {
+		sched_yield();
+		return;
+	}
+	const unsigned shift = *waited - spins > most ? most : *waited - spins;
+	struct timespec ts = { .tv_sec = 0, .tv_nsec = 1000l << shift };
+	nanosleep(&ts, NULL);
+}
+
+int embed_channel_putc_cb(int ch, void *channel) {
+	embed_channel_t *c = channel;
+	assert(c);
+	const uint8_t b = ch;
+	for (unsigned waited = 0; !embed_channel_write(c, &b, 1); embed_channel_backoff(&waited))
+		if (atomic_load_explicit(&c->hung_up, memory_order_acquire))
+			return EOF;
+	return ch;
+}
+
+void embed_channel_wait(embed_channel_t *c, unsigned long timeout) {
+	assert(c);
+	c->timeout = timeout;
+}
+
+static double embed_channel_seconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int embed_channel_getc_cb(void *channel, int *no_data) {
+	assert(channel && no_data);
+	const unsigned long timeout = ((embed_channel_t*)channel)->timeout;
+	double until = 0;
+	uint8_t b = 0;
+	for (unsigned waited = 0;; embed_channel_backoff(&waited)) {
+		if (embed_channel_read(channel, &b, 1)) {
+			*no_data = 0;
+			return b;
+		}
+		if (embed_channel_eof(channel)) {
+			*no_data = 0;
+			return EOF;
+		}
+		if (!timeout)
+			break;
+		const double now = embed_channel_seconds();
+		if (until == 0)
+			until = now + timeout / 1e6;
+		else if (now >= until)
+			break;
+	}
+	*no_data = -1;
+	return EOF;
+}
+
+#define EMBED_LOG_LOCAL (4) /**< logs a thread remembers its ring buffer in */
+
+/* The ring buffers a thread last used, and the logs they belong to. Logs are
+ * told apart by their 'id' as a new log may be allocated where an old one
+ * was freed, leaving an entry pointing to a ring that no longer exists. A
+ * thread that logs to more logs than this finds its ring by looking through
+ * the rings of the log, so it only ever has one in each. */
+static _Thread_local struct { unsigned long id; embed_log_ring_t *ring; } embed_log_local[EMBED_LOG_LOCAL];
+static _Thread_local unsigned embed_log_local_next;
+static atomic_ulong embed_log_ids = 1;
+
+static embed_log_ring_t *embed_log_ring(embed_log_t *l) {
+	assert(l);
+	for (size_t i = 0; i < EMBED_LOG_LOCAL; i++)
+		if (embed_log_local[i].id == l->id)
+			return embed_log_local[i].ring;
+	const pthread_t self = pthread_self();
+	embed_log_ring_t *r = atomic_load_explicit(&l->rings, memory_order_acquire);
+	while (r && !pthread_equal(r->owner, self))
+		r = r->next;
+	if (!r) { /* first line from this thread */
+		if (!(r = embed_alloc(sizeof *r)))
+			return NULL;
+		if (!(r->lines = embed_alloc((l->mask + 1) * sizeof *r->lines))) {
+			free(r);
+			return NULL;
+		}
+		atomic_init(&r->head, 0);
+		atomic_init(&r->tail, 0);
+		r->owner = self;
+		r->next = atomic_load_explicit(&l->rings, memory_order_relaxed);
+		while (!atomic_compare_exchange_weak_explicit(&l->rings, &r->next, r, memory_order_release, memory_order_relaxed))
+			;
+	}
+	const unsigned i = embed_log_local_next++ % EMBED_LOG_LOCAL;
+	embed_log_local[i].id = l->id, embed_log_local[i].ring = r;
+	return r;
+}
+
+void embed_log_sink_cb(void *log, embed_log_level_e level, const char *line, size_t length) {
+	embed_log_t *l = log;
+	assert(l && line);
+	UNUSED(level);
+	embed_log_ring_t *r = embed_log_ring(l);
+	if (!r) {
+		atomic_fetch_add_explicit(&l->dropped, 1, memory_order_relaxed);
+		return;
+	}
+	const size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	if (tail - atomic_load_explicit(&r->head, memory_order_acquire) > l->mask) {
+		atomic_fetch_add_explicit(&l->dropped, 1, memory_order_relaxed);
+		return;
+	}
+	embed_log_line_t *n = &r->lines[tail & l->mask];
+	n->length = length < sizeof n->line ? length : sizeof n->line;
+	memcpy(n->line, line, n->length);
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+}
+
+/* Lines are written out in the order they were logged by each thread, but
+ * lines from different threads may be written out of order. */
+static size_t embed_log_drain(embed_log_t *l) {
+	size_t n = 0;
+	for (embed_log_ring_t *r = atomic_load_explicit(&l->rings, memory_order_acquire); r; r = r->next) {
+		size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+		const size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+		for (; head != tail; head++, n++) {
+			const embed_log_line_t *line = &r->lines[head & l->mask];
+			fwrite(line->line, 1, line->length, l->out);
+		}
+		atomic_store_explicit(&r->head, head, memory_order_release);
+	}
+	if (n) {
+		fflush(l->out);
+		atomic_fetch_add_explicit(&l->written, n, memory_order_relaxed);
+	}
+	return n;
+}
+
+static void *embed_log_thread(void *param) {
+	embed_log_t *l = param;
+	for (;;) {
+		const int stop = atomic_load_explicit(&l->stop, memory_order_acquire);
+		if (embed_log_drain(l))
+			continue;
+		if (stop)
+			return NULL;
+		const struct timespec wait = { .tv_nsec = 1000000 };
+		nanosleep(&wait, NULL);
+	}
+}
+
+embed_log_t *embed_log_new(FILE *out, size_t lines) {
+	assert(out);
+	size_t s = 1;
+	while (s < lines)
+		if (!(s <<= 1))
+			return NULL;
+	embed_log_t *l = embed_alloc(sizeof *l);
+	if (!l)
+		return NULL;
+	l->out = out, l->mask = s - 1;
+	l->id = atomic_fetch_add(&embed_log_ids, 1);
+	atomic_init(&l->rings, NULL);
+	atomic_init(&l->written, 0);
+	atomic_init(&l->dropped, 0);
+	atomic_init(&l->stop, 0);
+	if (pthread_create(&l->thread, NULL, embed_log_thread, l)) {
+		free(l);
+		return NULL;
+	}
+	return l;
+}
+
+void embed_log_flush(embed_log_t *l) {
+	assert(l);
+	unsigned long queued = 0;
+	for (embed_log_ring_t *r = atomic_load_explicit(&l->rings, memory_order_acquire); r; r = r->next)
+		queued += atomic_load_explicit(&r->tail, memory_order_acquire);
+	while (atomic_load_explicit(&l->written, memory_order_relaxed) < queued) {
+		const struct timespec wait = { .tv_nsec = 1000000 };
+		nanosleep(&wait, NULL);
+	}
+}
+
+void embed_log_free(embed_log_t *l) {
+	if (!l)
+		return;
+	atomic_store_explicit(&l->stop, 1, memory_order_release);
+	pthread_join(l->thread, NULL);
+	for (embed_log_ring_t *r = atomic_load(&l->rings), *next = NULL; r; r = next) {
+		next = r->next;
+		free(r->lines);
+		free(r);
+	}
+	free(l);
+}
+
+void embed_log_stats(embed_log_t *l, unsigned long *written, unsigned long *dropped) {
+	assert(l);
+	if (written)
+		*written = atomic_load_explicit(&l->written, memory_order_relaxed);
+	if (dropped)
+		*dropped = atomic_load_explicit(&l->dropped, memory_order_relaxed);
+}
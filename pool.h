@@ -0,0 +1,195 @@
+/** @file      pool.h
+ *  @brief     Run virtual machines on many threads, and connect them together
+ *  @copyright Richard James Howe (2018)
+ *  @license   MIT
+ *
+ *  Each worker thread owns one virtual machine, which it reuses for every job
+ *  it runs, and a double ended queue of jobs. Jobs are handed out to the
+ *  queues in turn; a worker takes the newest job from its own queue and, when
+ *  that is empty, steals the oldest job from another worker's queue, so that
+ *  no worker sits idle whilst there is work to do. Every job starts from a
+ *  fresh copy of its image and nothing is shared between jobs, the pool does
+ *  not use the logging functions in 'util.h' or any other global state.
+ *
+ *  Channels connect the output of one virtual machine to the input of
+ *  another in the same process, so that Forth programs can be chained into a
+ *  pipeline without going through the operating system. A channel is a
+ *  bounded queue of bytes with one writer and one reader, which may be on
+ *  different threads, and it does not use locks.
+ *
+ *  An asynchronous log can be used as the sink for the logging functions in
+ *  'util.h', so that threads running virtual machines never wait on stderr.
+ *  Each thread that logs gets its own ring buffer of formatted lines, which a
+ *  thread owned by the log drains; a line is dropped, and counted, if its
+ *  ring buffer is full rather than making the logging thread wait.
+ *
+ *  This needs POSIX threads and C11 atomics, link with '-pthread'. */
+#ifndef POOL_H
+#define POOL_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "embed.h"
+#include "util.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct embed_job_t embed_job_t;   /**< A job for the pool to run */
+typedef struct embed_pool_t embed_pool_t; /**< A pool of worker threads */
+typedef struct embed_channel_t embed_channel_t; /**< A queue of bytes between two virtual machines */
+typedef struct embed_log_t embed_log_t;   /**< An asynchronous log */
+
+/**@brief Function pointer typedef for functions called when a job finishes,
+ * it is called by the worker thread that ran the job, with no locks held.
+ * @param job, the job that has finished */
+typedef void (*embed_job_done_t)(embed_job_t *job);
+
+struct embed_job_t {
+	const uint8_t *image;      /**< image to run, NULL for the default image, the buffer may be reused */
+	size_t image_length;       /**< length of 'image' in bytes */
+	const char *input;         /**< ASCII NUL terminated input for the image, may be NULL */
+	char *output;              /**< buffer for output, may be NULL */
+	size_t output_max,         /**< size of 'output' in bytes */
+	       output_length;      /**< bytes output, more than 'output_max' if some were lost */
+	int output_grow;           /**< if set 'output' was got from 'malloc', or is NULL, and is grown with 'realloc' to fit */
+	embed_vm_option_e options; /**< virtual machine options to run with */
+	int result;                /**< value returned by 'embed_vm', or the error loading the image */
+	embed_job_done_t done;     /**< called when the job has finished, may be NULL */
+	void *param;               /**< for use by 'done' */
+}; /**< A job, owned by the caller, which must leave it alone until it is done */
+
+/**@brief Make a new pool and start its worker threads
+ * @param workers, number of worker threads, and virtual machines, to use
+ * @param depth, number of jobs each worker can have waiting in its queue
+ * @return a new pool, or NULL on failure */
+embed_pool_t *embed_pool_new(size_t workers, size_t depth);
+
+/**@brief Hand a job to the pool, this waits for room in the queues if they
+ * are all full.
+ * @param p, pool to run the job
+ * @param job, job to run, it is not copied
+ * @return zero on success, negative if the pool is being freed */
+int embed_pool_submit(embed_pool_t *p, embed_job_t *job);
+
+/**@brief Wait for all the jobs handed to the pool to finish
+ * @param p, pool to wait for */
+void embed_pool_wait(embed_pool_t *p);
+
+/**@brief Wait for all jobs to finish, stop the workers and free a pool
+ * @param p, pool to free, may be NULL */
+void embed_pool_free(embed_pool_t *p);
+
+/**@brief Make a new, empty, channel
+ * @param size, number of bytes the channel can hold, rounded up to a power
+ * of two
+ * @return a new channel, or NULL on failure */
+embed_channel_t *embed_channel_new(size_t size);
+
+/**@brief Free a channel, neither end may be in use
+ * @param c, channel to free, may be NULL */
+void embed_channel_free(embed_channel_t *c);
+
+/**@brief Write as many bytes as there is room for into a channel, this does
+ * not wait. Only the writer may call this.
+ * @param c, channel to write to
+ * @param buf, bytes to write
+ * @param length, number of bytes in 'buf'
+ * @return number of bytes written */
+size_t embed_channel_write(embed_channel_t *c, const void *buf, size_t length);
+
+/**@brief Read as many bytes as are waiting in a channel, up to 'length',
+ * this does not wait. Only the reader may call this.
+ * @param c, channel to read from
+ * @param buf, buffer to read into
+ * @param length, size of 'buf'
+ * @return number of bytes read */
+size_t embed_channel_read(embed_channel_t *c, void *buf, size_t length);
+
+/**@brief Close the writing end of a channel, the reader gets EOF once it has
+ * read what is left in the channel. Only the writer may call this.
+ * @param c, channel to close */
+void embed_channel_close(embed_channel_t *c);
+
+/**@brief Close the reading end of a channel, anything written to it from
+ * then on is thrown away and 'embed_channel_putc_cb' returns EOF rather than
+ * waiting for room. Only the reader may call this.
+ * @param c, channel to hang up */
+void embed_channel_hangup(embed_channel_t *c);
+
+/**@brief Is a channel closed, and empty?
+ * @param c, channel to look at
+ * @return non zero if there is nothing more to read */
+int embed_channel_eof(embed_channel_t *c);
+
+/**@brief Set how long 'embed_channel_getc_cb' waits for data before it
+ * gives up, the default is not to wait. Set this before the reader runs.
+ * @param c, channel to set the time for
+ * @param timeout, microseconds to wait for */
+void embed_channel_wait(embed_channel_t *c, unsigned long timeout);
+
+/**@brief 'embed_fputc_t' callback to write to a channel, pass the channel as
+ * the 'out' option. If the channel is full this waits for the reader to make
+ * room, which it will never do if the reader runs on the same thread, so use
+ * 'embed_channel_full_cb' as well in that case. It yields a few times and
+ * then sleeps between looks at the channel, and gives up if the reader has
+ * hung up with 'embed_channel_hangup'.
+ * @param ch, byte to write
+ * @param channel, channel to write to
+ * @return 'ch', or EOF if the reader has hung up */
+int embed_channel_putc_cb(int ch, void *channel);
+
+/**@brief 'embed_fgetc_t' callback to read from a channel, pass the channel as
+ * the 'in' option. If the channel is empty this waits for up to the time set
+ * with 'embed_channel_wait' for data, in the same way as 'embed_channel_putc_cb' waits for room,
+ * and then sets 'no_data' so the eForth image yields.
+ * @param channel, channel to read from
+ * @param no_data, set to -1 if there is no data at the moment
+ * @return a byte, or EOF if the channel is closed and empty */
+int embed_channel_getc_cb(void *channel, int *no_data);
+
+/**@brief 'embed_yield_t' callback to make the writing virtual machine yield
+ * when its output channel is full, pass the channel as the 'yields' option.
+ * An instruction outputs a byte at most, so the virtual machine never has to
+ * wait in 'embed_channel_putc_cb' when using this.
+ * @param channel, channel the virtual machine writes to
+ * @return non zero if the channel is full */
+int embed_channel_full_cb(void *channel);
+
+/**@brief Make a new asynchronous log and start the thread that writes it
+ * out, pass it to 'embed_log_sink_set' along with 'embed_log_sink_cb'.
+ * @param out, file to write log lines to, such as stderr
+ * @param lines, number of lines each logging thread can have waiting, it is
+ * rounded up to a power of two
+ * @return a new log, or NULL on failure */
+embed_log_t *embed_log_new(FILE *out, size_t lines);
+
+/**@brief Wait for the lines queued in a log so far to be written out
+ * @param l, log to flush */
+void embed_log_flush(embed_log_t *l);
+
+/**@brief Write out what is left in a log, stop its thread and free it. The
+ * log must not be in use, call 'embed_log_sink_set(NULL, NULL)' first.
+ * @param l, log to free, may be NULL */
+void embed_log_free(embed_log_t *l);
+
+/**@brief 'embed_log_sink_t' callback that queues a line in a log, this never
+ * waits, but it allocates a ring buffer the first time a thread uses it.
+ * @param log, log to queue the line in
+ * @param level, level of the line, not used
+ * @param line, line to queue
+ * @param length, length of 'line' */
+void embed_log_sink_cb(void *log, embed_log_level_e level, const char *line, size_t length);
+
+/**@brief Get the number of lines written out and dropped by a log so far
+ * @param l, log to look at
+ * @param written, number of lines written to the file, may be NULL
+ * @param dropped, number of lines dropped as a ring buffer was full, or
+ * one could not be allocated, may be NULL */
+void embed_log_stats(embed_log_t *l, unsigned long *written, unsigned long *dropped);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,68 @@
+/* Table driven MMU generated by 'mmu', see 't/mmu.c' */
+#include "embed.h"
+#include "util.h"
+#include <assert.h>
+#include <stdint.h>
+
+#define PAGE_SIZE (128u)
+#define NPAGES    (24u)
+#define ROM       (-1)
+#define NONE      (-2)
+
+static cell_t ram[NPAGES][PAGE_SIZE];
+
+static const int16_t table[EMBED_CORE_SIZE / PAGE_SIZE] = {
+	  0,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+	 -1,  -1,  -1,  -1,  -1,   1,   2,   3,   4,   5,   6,   7,   8,   9,  10,  11,
+	 12,  13,  14,  15,  16,  17,  18,  19,  20,  -2,  -2,  -2,  -2,  -2,  -2,  -2,
+	 -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,
+	 21,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  22,  -2,  -2,  -2,  -2,  -2,  -2,  -2,
+	 -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,
+	 -2,  -1,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,
+	 -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,
+	 -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,
+	 -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,
+	 -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,
+	 -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,
+	 -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,
+	 -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,
+	 -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,
+	 -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  -2,  23,
+};
+
+static cell_t rom(cell_t addr) {
+	const size_t b = (size_t)addr << 1;
+	if ((b + 1) >= embed_default_block_size)
+		return 0;
+	return (embed_default_block[b + 1] << 8u) | embed_default_block[b];
+}
+
+static cell_t gen_read_cb(embed_t const * const h, cell_t addr) {
+	assert(h);
+	assert(!(0x8000 & addr));
+	const int page = table[addr / PAGE_SIZE];
+	if (page >= 0)
+		return ram[page][addr % PAGE_SIZE];
+	return page == ROM ? rom(addr) : 0;
+}
+
+static void gen_write_cb(embed_t * const h, cell_t addr, cell_t value) {
+	assert(h);
+	assert(!(0x8000 & addr));
+	const int page = table[addr / PAGE_SIZE];
+	if (page >= 0)
+		ram[page][addr % PAGE_SIZE] = value;
+}
+
+int main(void) {
+	static embed_t h;
+	h.m = ram;
+	for (size_t i = 0; i < EMBED_CORE_SIZE; i++)
+		if (table[i / PAGE_SIZE] >= 0)
+			ram[table[i / PAGE_SIZE]][i % PAGE_SIZE] = rom(i);
+	embed_opt_t o = embed_opt_default_hosted();
+	o.read  = gen_read_cb;
+	o.write = gen_write_cb;
+	embed_opt_set(&h, &o);
+	return embed_vm(&h);
+}
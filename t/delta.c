@@ -0,0 +1,86 @@
+/**@brief Embed library image delta program
+ * @license MIT
+ * @author Richard James Howe
+ * @file delta.c
+ *
+ * See <https://github.com/howerj/embed> for more information.
+ *
+ * This program computes block level binary deltas between two images and
+ * applies them to an image on disk, the same patches can be applied to a
+ * running virtual machine with 'embed_patch' whilst it is stopped at a yield
+ * so that a small change to an image does not mean shipping and reloading an
+ * entire image. Usage:
+ *
+ * 	./delta diff old.blk new.blk out.dif
+ * 	./delta apply in.blk in.dif out.blk */
+
+#include "util.h"
+#include "embed.h"
+#include <stdint.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PATCH_MAX (EMBED_CORE_SIZE * 2 * sizeof(cell_t)) /* generous upper bound on patch size */
+
+static embed_t *load_or_die(const char *name) {
+	assert(name);
+	embed_t *h = embed_new();
+	if (!h)
+		embed_fatal("embed: allocate failed");
+	memset(embed_core_get(h), 0, EMBED_CORE_SIZE * sizeof(cell_t));
+	if (embed_load(h, name) < 0)
+		embed_fatal("embed: load failed (input = %s)", name);
+	return h;
+}
+
+static int diff(const char *old, const char *new, const char *out) {
+	assert(old && new && out);
+	embed_t *from = load_or_die(old), *to = load_or_die(new);
+	size_t length = PATCH_MAX;
+	uint8_t *patch = embed_alloc(length);
+	if (!patch)
+		embed_fatal("delta: allocate failed");
+	if (embed_diff(from, to, patch, &length) < 0)
+		embed_fatal("delta: diff failed");
+	FILE *o = embed_fopen_or_die(out, "wb");
+	const int r = fwrite(patch, 1, length, o) == length ? 0 : -1;
+	fclose(o);
+	free(patch);
+	embed_free(from);
+	embed_free(to);
+	return r;
+}
+
+static int apply(const char *in, const char *delta, const char *out) {
+	assert(in && delta && out);
+	embed_t *h = load_or_die(in);
+	uint8_t *patch = embed_alloc(PATCH_MAX);
+	if (!patch)
+		embed_fatal("delta: allocate failed");
+	FILE *d = embed_fopen_or_die(delta, "rb");
+	const size_t length = fread(patch, 1, PATCH_MAX, d);
+	fclose(d);
+	int r = embed_patch(h, patch, length);
+	if (r < 0) {
+		embed_error("delta: patch failed (patch = %s, error = %d)", delta, r);
+	} else {
+		size_t cells = embed_cells(h);
+		for (; cells && !embed_core_get(h)[cells - 1]; cells--) /* trailing zeros are not saved */
+			;
+		r = embed_save_cb(h, out, 0, cells);
+	}
+	free(patch);
+	embed_free(h);
+	return r;
+}
+
+int main(int argc, char **argv) {
+	if (argc == 5 && !strcmp(argv[1], "diff"))
+		return diff(argv[2], argv[3], argv[4]);
+	if (argc == 5 && !strcmp(argv[1], "apply"))
+		return apply(argv[2], argv[3], argv[4]);
+	fprintf(stderr, "usage: %s diff old.blk new.blk out.dif\n", argv[0]);
+	fprintf(stderr, "usage: %s apply in.blk in.dif out.blk\n", argv[0]);
+	return 1;
+}
@@ -0,0 +1,221 @@
+/**@brief Embed library worker pool example and benchmark
+ * @license MIT
+ * @author Richard James Howe
+ * @file jobs.c
+ *
+ * See <https://github.com/howerj/embed> for more information.
+ *
+ * This program runs a batch of small, independent, eForth jobs on a pool
+ * of worker threads (see 'pool.h'), checks the output of each one and prints
+ * how many jobs a second were run. Each job evaluates a different string on
+ * a fresh copy of the default image. Usage:
+ *
+ * 	./jobs [jobs] [workers]
+ *
+ * The number of workers defaults to the number of processors, the batch is
+ * run once with a single worker as well so the two can be compared. It is
+ * then run again with each job logging a line to an asynchronous log, which
+ * is checked for lines that went missing, and one thread takes turns logging
+ * to several logs, which must each get its lines in order. Lastly one buffer is reused for two
+ * different images, to check that a worker does not run the second job on
+ * the image it booted for the first, and a job's output buffer is grown to
+ * hold more output than it started with. */
+
+#define _POSIX_C_SOURCE 200809L
+#include "pool.h"
+#include "util.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OUTPUT_MAX (64)
+
+typedef struct {
+	embed_job_t job;
+	char input[64], output[OUTPUT_MAX], expect[32];
+} test_job_t;
+
+static double seconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int logging = 0; /* set before the pool is made, so its threads see it */
+
+static void done(embed_job_t *job) { /* check output, in the worker thread */
+	test_job_t *t = job->param;
+	const size_t l = strlen(t->expect);
+	job->result = (job->result == 0 && job->output_length == l && !memcmp(t->output, t->expect, l)) ? 0 : -1;
+	if (logging)
+		embed_info("job '%.*s' gave '%s'", (int)strcspn(t->input, "\n"), t->input, t->expect);
+}
+
+static int run(test_job_t *jobs, size_t count, size_t workers) {
+	embed_pool_t *p = embed_pool_new(workers, 64);
+	if (!p)
+		embed_fatal("jobs: pool allocation failed");
+	for (size_t i = 0; i < count; i++) {
+		test_job_t *t = &jobs[i];
+		memset(&t->job, 0, sizeof t->job);
+		t->job.input      = t->input;
+		t->job.output     = t->output, t->job.output_max = sizeof t->output;
+		t->job.options    = EMBED_VM_QUITE_ON;
+		t->job.done       = done,      t->job.param = t;
+	}
+	const double start = seconds();
+	for (size_t i = 0; i < count; i++)
+		if (embed_pool_submit(p, &jobs[i].job) < 0)
+			embed_fatal("jobs: submit failed");
+	embed_pool_wait(p);
+	const double taken = seconds() - start;
+	embed_pool_free(p);
+	size_t failed = 0;
+	for (size_t i = 0; i < count; i++)
+		failed += jobs[i].job.result != 0;
+	fprintf(stdout, "workers %3u: %u jobs in %.3fs, %.0f jobs/s, %u failed\n",
+			(unsigned)workers, (unsigned)count, taken, count / taken, (unsigned)failed);
+	return failed ? -1 : 0;
+}
+
+static int logged(test_job_t *jobs, size_t count, size_t workers) {
+	FILE *file = tmpfile();
+	embed_log_t *l = file ? embed_log_new(file, 256) : NULL;
+	if (!l)
+		embed_fatal("jobs: log allocation failed");
+	embed_log_sink_set(embed_log_sink_cb, l);
+	logging = 1;
+	int r = run(jobs, count, workers);
+	logging = 0;
+	embed_log_sink_set(NULL, NULL);
+	embed_log_flush(l);
+	unsigned long written = 0, dropped = 0, lines = 0;
+	embed_log_stats(l, &written, &dropped);
+	embed_log_free(l);
+	rewind(file);
+	for (int ch = 0; (ch = fgetc(file)) != EOF; )
+		lines += ch == '\n';
+	fclose(file);
+	if (lines != written || written + dropped != count)
+		r = -1;
+	fprintf(stdout, "log: %lu lines written, %lu dropped, %s\n", written, dropped, r ? "FAILED" : "ok");
+	return r;
+}
+
+static int alternated(void) {
+	enum { LOGS = 6, LINES = 100 }; /* more logs than a thread remembers a ring for */
+	FILE *file[LOGS];
+	embed_log_t *l[LOGS];
+	int r = 0;
+	for (size_t i = 0; i < LOGS; i++)
+		if (!(file[i] = tmpfile()) || !(l[i] = embed_log_new(file[i], LINES)))
+			embed_fatal("jobs: log allocation failed");
+	for (unsigned i = 0; i < LOGS * LINES; i++) {
+		char line[32];
+		const int length = snprintf(line, sizeof line, "%u\n", i / LOGS);
+		embed_log_sink_cb(l[i % LOGS], EMBED_LOG_LEVEL_INFO, line, length);
+	}
+	for (size_t i = 0; i < LOGS; i++) {
+		embed_log_free(l[i]), l[i] = NULL;
+		rewind(file[i]);
+		unsigned next = 0;
+		for (unsigned line = 0; fscanf(file[i], "%u", &line) == 1; next++)
+			if (line != next)
+				r = -1;
+		if (next != LINES)
+			r = -1;
+		fclose(file[i]);
+	}
+	fprintf(stdout, "alternating logs: %s\n", r ? "FAILED" : "ok");
+	return r;
+}
+
+static int reused(void) {
+	embed_t *h = embed_new();
+	const size_t length = h ? embed_length(h) : 0;
+	uint8_t *image = embed_alloc(length);
+	embed_pool_t *p = embed_pool_new(1, 4);
+	if (!h || !image || !p)
+		embed_fatal("jobs: allocation failed");
+	embed_opt_t o = *embed_opt_get(h);
+	o.options = EMBED_VM_QUITE_ON;
+	embed_opt_set(h, &o);
+	test_job_t t[2] = {
+		{ .input = "2 u. bye\n", .expect = " 2" },
+		{ .input = "y u. bye\n", .expect = " 7" },
+	};
+	int r = 0;
+	for (size_t i = 0; i < 2; i++) { /* same buffer and length, new contents */
+		if (i && embed_eval(h, ": y 7 ;\n") < 0)
+			embed_fatal("jobs: eval failed");
+		const cell_t *m = embed_core_get(h);
+		for (size_t j = 0; j < length / 2; j++)
+			image[j*2] = m[j] & 0xFF, image[j*2 + 1] = m[j] >> 8;
+		t[i].job.image   = image,       t[i].job.image_length = length;
+		t[i].job.input   = t[i].input;
+		t[i].job.output  = t[i].output, t[i].job.output_max = sizeof t[i].output;
+		t[i].job.options = EMBED_VM_QUITE_ON;
+		t[i].job.done    = done,        t[i].job.param = &t[i];
+		if (embed_pool_submit(p, &t[i].job) < 0)
+			embed_fatal("jobs: submit failed");
+		embed_pool_wait(p);
+		if (t[i].job.result)
+			r = -1;
+	}
+	embed_pool_free(p);
+	free(image);
+	embed_free(h);
+	fprintf(stdout, "reused image buffer: %s\n", r ? "FAILED" : "ok");
+	return r;
+}
+
+static int grown(void) {
+	embed_pool_t *p = embed_pool_new(1, 4);
+	if (!p)
+		embed_fatal("jobs: allocation failed");
+	embed_job_t job = {
+		.input = ": go 999 for r@ 1000 + . next ; go bye\n", /* 5000 bytes */
+		.options = EMBED_VM_QUITE_ON, .output_grow = 1,
+	};
+	if (embed_pool_submit(p, &job) < 0)
+		embed_fatal("jobs: submit failed");
+	embed_pool_free(p);
+	const int r = job.result == 0 && job.output_length == 5000 && job.output_max >= 5000
+		&& !memcmp(job.output, " 1999", 5) && !memcmp(job.output + 4995, " 1000", 5) ? 0 : -1;
+	free(job.output);
+	fprintf(stdout, "grown output buffer: %s\n", r ? "FAILED" : "ok");
+	return r;
+}
+
+int main(int argc, char **argv) {
+	if (argc > 3) {
+		fprintf(stderr, "usage: %s [jobs] [workers]\n", argv[0]);
+		return 1;
+	}
+	const long online = sysconf(_SC_NPROCESSORS_ONLN);
+	const size_t count   = argc > 1 ? strtoul(argv[1], NULL, 0) : 2000;
+	const size_t workers = argc > 2 ? strtoul(argv[2], NULL, 0) : (online > 0 ? (size_t)online : 1);
+	test_job_t *jobs = embed_alloc(count * sizeof *jobs);
+	if (!jobs || !workers)
+		embed_fatal("jobs: invalid arguments");
+	for (size_t i = 0; i < count; i++) {
+		snprintf(jobs[i].input, sizeof jobs[i].input, "%u 3 * 1+ u. bye\n", (unsigned)i);
+		snprintf(jobs[i].expect, sizeof jobs[i].expect, " %u", (unsigned)(i * 3 + 1) & 0xFFFFu);
+	}
+	int r = run(jobs, count, 1);
+	if (workers > 1 && run(jobs, count, workers) < 0)
+		r = -1;
+	if (logged(jobs, count, workers) < 0)
+		r = -1;
+	if (alternated() < 0)
+		r = -1;
+	if (reused() < 0)
+		r = -1;
+	if (grown() < 0)
+		r = -1;
+	free(jobs);
+	return r < 0 ? 1 : 0;
+}
@@ -8,7 +8,16 @@
  * This test program implements custom MMU read and write functions that log
  * the locations the virtual machine reads and writes to, this can be useful
  * for creating a memory map that would allow sections of memory to be placed
- * into Read Only Memory (ROM) to save on space.  */
+ * into Read Only Memory (ROM) to save on space.
+ *
+ * Instruction fetches are told apart from other reads as the virtual machine
+ * calls the yield callback before each fetch. Each cell is classified as
+ * code, read only data or read-write, and given the '-g file.c' option a
+ * table driven MMU, like the hand written one in 'rom.c', is generated. Pages
+ * that are written to are placed in RAM, pages that are only read are served
+ * from the built in image and pages that are never used are not mapped.
+ * The generated MMU is only as good as the workloads given to this program,
+ * writes to pages not written to by them are lost.  */
 
 #include "util.h"
 #include "embed.h"
@@ -21,6 +30,7 @@
 #include <string.h>
 
 #define MMU_REPORT ("mmu.log")
+#define PAGE_SIZE  (128u)
 
 /* ================= Bit Map Routines : Start ============================= */
 
@@ -98,10 +108,21 @@ bool bitmap_get(bitmap_t *b, size_t bit) {
 
 static bitmap_t *read_map  = NULL;
 static bitmap_t *write_map = NULL;
+static bitmap_t *fetch_map = NULL;
+static bool fetching = false;
+
+static int mmu_yield_cb(void *param) {
+	(void)param;
+	fetching = true; /* next read is an instruction fetch */
+	return 0;
+}
 
 static cell_t  mmu_read_cb(embed_t const * const h, cell_t addr) {
 	assert(!(0x8000 & addr));
 	bitmap_set(read_map, addr);
+	if (fetching)
+		bitmap_set(fetch_map, addr);
+	fetching = false;
 	return ((cell_t*)h->m)[addr];
 }
 
@@ -167,13 +188,41 @@ static void bitmap_print_range(bitmap_t *b, FILE *out) {
 	return 0;
 }*/
 
-static int bitmap_report(const char *name, bitmap_t *read_map, bitmap_t *write_map) {
+typedef enum {
+	PAGE_NONE = -2, /**< page is never used, it is not mapped */
+	PAGE_ROM  = -1, /**< page is only read, it is served from the image */
+} page_e; /**< page table entries, positive values are RAM page numbers */
+
+#define NPAGES (EMBED_CORE_SIZE / PAGE_SIZE)
+
+static int page_table(bitmap_t *read_map, bitmap_t *write_map, int table[NPAGES]) {
+	int ram = 0;
+	for (size_t i = 0; i < NPAGES; i++) {
+		bool read = false, written = false;
+		for (size_t j = i * PAGE_SIZE; j < (i + 1) * PAGE_SIZE; j++) {
+			read    |= bitmap_get(read_map, j);
+			written |= bitmap_get(write_map, j);
+		}
+		table[i] = written ? ram++ : read ? PAGE_ROM : PAGE_NONE;
+	}
+	return ram;
+}
+
+static int bitmap_report(const char *name, bitmap_t *read_map, bitmap_t *write_map, bitmap_t *fetch_map) {
 	assert(name);
 	assert(read_map);
 	assert(write_map);
+	assert(fetch_map);
 	bitmap_t *u = bitmap_union(read_map, write_map);
-	if (!u)
+	bitmap_t *code = bitmap_copy(fetch_map), *data = bitmap_copy(read_map);
+	if (!u || !code || !data)
 		embed_fatal("report: union allocation failed");
+	for (size_t i = 0; i < bitmap_bits(u); i++) {
+		if (bitmap_get(write_map, i))
+			bitmap_clear(code, i);
+		if (bitmap_get(write_map, i) || bitmap_get(fetch_map, i))
+			bitmap_clear(data, i);
+	}
 	FILE *report = embed_fopen_or_die(name, "wb");
 	fprintf(report, "write:\n");
 	bitmap_print_range(write_map, report);
@@ -181,21 +230,112 @@ static int bitmap_report(const char *name, bitmap_t *read_map, bitmap_t *write_m
 	bitmap_print_range(read_map, report);
 	fprintf(report, "rw:\n");
 	bitmap_print_range(u, report);
+	fprintf(report, "code:\n");
+	bitmap_print_range(code, report);
+	fprintf(report, "read-only data:\n");
+	bitmap_print_range(data, report);
+	int table[NPAGES] = { 0 };
+	const int ram = page_table(read_map, write_map, table);
+	fprintf(report, "pages (%u cells each, %d in RAM):\n", PAGE_SIZE, ram);
+	for (size_t i = 0; i < NPAGES; i++)
+		if (table[i] != PAGE_NONE)
+			fprintf(report, "%5zu\t%zu-%zu\t%s\n", i, i * PAGE_SIZE, (i + 1) * PAGE_SIZE - 1, table[i] == PAGE_ROM ? "rom" : "ram");
+	bitmap_free(data);
+	bitmap_free(code);
 	bitmap_free(u);
 	fclose(report);
 	return 0;
 }
 
+static const char generated_mmu[] = "\
+/* Table driven MMU generated by 'mmu', see 't/mmu.c' */\n\
+#include \"embed.h\"\n\
+#include \"util.h\"\n\
+#include <assert.h>\n\
+#include <stdint.h>\n\
+\n\
+#define PAGE_SIZE (%uu)\n\
+#define NPAGES    (%du)\n\
+#define ROM       (%d)\n\
+#define NONE      (%d)\n\
+\n\
+static cell_t ram[NPAGES][PAGE_SIZE];\n\
+\n\
+static const int16_t table[EMBED_CORE_SIZE / PAGE_SIZE] = {\n";
+
+static const char generated_mmu_end[] = "\
+};\n\
+\n\
+static cell_t rom(cell_t addr) {\n\
+\tconst size_t b = (size_t)addr << 1;\n\
+\tif ((b + 1) >= embed_default_block_size)\n\
+\t\treturn 0;\n\
+\treturn (embed_default_block[b + 1] << 8u) | embed_default_block[b];\n\
+}\n\
+\n\
+static cell_t gen_read_cb(embed_t const * const h, cell_t addr) {\n\
+\tassert(h);\n\
+\tassert(!(0x8000 & addr));\n\
+\tconst int page = table[addr / PAGE_SIZE];\n\
+\tif (page >= 0)\n\
+\t\treturn ram[page][addr %% PAGE_SIZE];\n\
+\treturn page == ROM ? rom(addr) : 0;\n\
+}\n\
+\n\
+static void gen_write_cb(embed_t * const h, cell_t addr, cell_t value) {\n\
+\tassert(h);\n\
+\tassert(!(0x8000 & addr));\n\
+\tconst int page = table[addr / PAGE_SIZE];\n\
+\tif (page >= 0)\n\
+\t\tram[page][addr %% PAGE_SIZE] = value;\n\
+}\n\
+\n\
+int main(void) {\n\
+\tstatic embed_t h;\n\
+\th.m = ram;\n\
+\tfor (size_t i = 0; i < EMBED_CORE_SIZE; i++)\n\
+\t\tif (table[i / PAGE_SIZE] >= 0)\n\
+\t\t\tram[table[i / PAGE_SIZE]][i %% PAGE_SIZE] = rom(i);\n\
+\tembed_opt_t o = embed_opt_default_hosted();\n\
+\to.read  = gen_read_cb;\n\
+\to.write = gen_write_cb;\n\
+\tembed_opt_set(&h, &o);\n\
+\treturn embed_vm(&h);\n\
+}\n";
+
+static int generate(const char *name, bitmap_t *read_map, bitmap_t *write_map) {
+	assert(name);
+	int table[NPAGES] = { 0 };
+	const int ram = page_table(read_map, write_map, table);
+	FILE *out = embed_fopen_or_die(name, "wb");
+	fprintf(out, generated_mmu, PAGE_SIZE, ram + !ram, PAGE_ROM, PAGE_NONE);
+	for (size_t i = 0; i < NPAGES; i++)
+		fprintf(out, "%s%3d,%s", i % 16 ? " " : "\t", table[i], (i % 16) == 15 ? "\n" : "");
+	fprintf(out, generated_mmu_end);
+	return fclose(out) ? -1 : 0;
+}
+
 int main(int argc, char **argv) {
-	int r = 0;
+	int r = 0, ch = 0;
+	const char *gen = NULL;
 	read_map  = bitmap_new(UINT16_MAX);
 	write_map = bitmap_new(UINT16_MAX);
-	if (!read_map || !write_map)
+	fetch_map = bitmap_new(UINT16_MAX);
+	if (!read_map || !write_map || !fetch_map)
 		embed_fatal("bitmap: allocate failed");
 
+	embed_getopt_t go = { .init = 0, .error = 1 };
+	while ((ch = embed_getopt(&go, argc, argv, "g:")) != -1) {
+		switch (ch) {
+		case 'g': gen = go.arg; break;
+		default: embed_fatal("usage: %s [-g mmu.c] [file.fth...]", argv[0]);
+		}
+	}
+
 	embed_opt_t o = embed_opt_default_hosted();
 	o.read  = mmu_read_cb;
 	o.write = mmu_write_cb;
+	o.yield = mmu_yield_cb;
 
 	embed_t *h = embed_new();
 	if (!h)
@@ -203,9 +343,9 @@ int main(int argc, char **argv) {
 
 	embed_opt_set(h, &o);
 
-	if (argc > 1) {
+	if (argc > go.index) {
 		o.options |= EMBED_VM_QUITE_ON;
-		for (int i = 1; i < argc; i++) {
+		for (int i = go.index; i < argc; i++) {
 			FILE *in = embed_fopen_or_die(argv[i], "rb");
 			o.in = in;
 			embed_opt_set(h, &o);
@@ -221,7 +361,10 @@ int main(int argc, char **argv) {
 	}
 
 	embed_free(h);
-	bitmap_report(MMU_REPORT, read_map, write_map);
+	bitmap_report(MMU_REPORT, read_map, write_map, fetch_map);
+	if (gen && generate(gen, read_map, write_map) < 0)
+		embed_fatal("unable to write MMU to '%s'", gen);
+	bitmap_free(fetch_map);
 	bitmap_free(read_map);
 	bitmap_free(write_map);
 	return r;
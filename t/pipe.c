@@ -0,0 +1,149 @@
+/**@brief Embed library channel example, a two stage pipeline
+ * @license MIT
+ * @author Richard James Howe
+ * @file pipe.c
+ *
+ * See <https://github.com/howerj/embed> for more information.
+ *
+ * This program connects the output of one virtual machine to the input of
+ * another with a channel (see 'pool.h'). The first writes out a Forth
+ * program, which the second runs. This is done twice, first with both
+ * virtual machines taking turns on one thread, then with each on its own
+ * thread, and the output of the second is checked each time. Lastly the
+ * reader hangs up part way through, which must stop the writer from waiting
+ * for room in the channel. Usage:
+ *
+ * 	./pipe [count]
+ *
+ * Where 'count' is the number of lines the first virtual machine writes. */
+
+#define _POSIX_C_SOURCE 200809L
+#include "pool.h"
+#include "util.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHANNEL_SIZE (256)
+
+typedef struct {
+	embed_t *h;
+	char program[128];
+	const char *in;
+	char *out;
+	size_t out_length, out_max;
+} stage_t;
+
+static int buffer_putc(int ch, void *file) {
+	stage_t *s = file;
+	if (s->out_length < s->out_max)
+		s->out[s->out_length] = ch;
+	s->out_length++;
+	return ch;
+}
+
+static void stages(stage_t *s, embed_channel_t *c, unsigned count, char *out, size_t out_max, int threaded) {
+	for (size_t i = 0; i < 2; i++) {
+		if (!(s[i].h = embed_new()))
+			embed_fatal("pipe: allocate failed");
+		embed_opt_t o = *embed_opt_get(s[i].h);
+		o.options = EMBED_VM_QUITE_ON;
+		if (i == 0) { /* writes a program into the channel */
+			snprintf(s[i].program, sizeof s[i].program,
+				": go %u for r@ . .\"  2 * u.\" cr next ; go bye\n", count - 1);
+			s[i].in = s[i].program;
+			o.get   = embed_sgetc_cb,        o.in     = &s[i].in;
+			o.put   = embed_channel_putc_cb, o.out    = c;
+			if (!threaded) /* yield when full, 'embed_channel_putc_cb' waits otherwise */
+				o.yield = embed_channel_full_cb, o.yields = c;
+		} else { /* runs the program, writing to a buffer */
+			s[i].out = out, s[i].out_max = out_max;
+			o.get   = embed_channel_getc_cb, o.in     = c;
+			o.put   = buffer_putc,           o.out    = &s[i];
+			embed_channel_wait(c, threaded ? 1000 : 0);
+		}
+		embed_opt_set(s[i].h, &o);
+	}
+}
+
+static void *writer(void *param) {
+	stage_t *s = param;
+	while (embed_vm(s->h) > 0)
+		;
+	embed_channel_close(embed_opt_get(s->h)->out);
+	return NULL;
+}
+
+static int check(const char *mode, stage_t *s, unsigned count) {
+	char expect[16];
+	size_t at = 0;
+	int r = 0;
+	for (unsigned i = count; i-- > 0; at += strlen(expect)) {
+		snprintf(expect, sizeof expect, " %u", i * 2);
+		if (at + strlen(expect) > s[1].out_length || memcmp(s[1].out + at, expect, strlen(expect)))
+			r = -1;
+	}
+	if (at != s[1].out_length)
+		r = -1;
+	fprintf(stdout, "%s: %u bytes through the channel, %s\n", mode, (unsigned)s[1].out_length, r ? "FAILED" : "ok");
+	embed_free(s[0].h);
+	embed_free(s[1].h);
+	return r;
+}
+
+int main(int argc, char **argv) {
+	const unsigned count = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000;
+	const size_t out_max = count * 8 + 1;
+	char *out = embed_alloc(out_max);
+	embed_channel_t *c = embed_channel_new(CHANNEL_SIZE);
+	stage_t s[2];
+	int r = 0;
+	if (!out || !c || !count || count > 10000)
+		embed_fatal("pipe: invalid arguments");
+
+	memset(s, 0, sizeof s);
+	stages(s, c, count, out, out_max, 0);
+	for (int done = 0, r1 = 1; r1 > 0; ) { /* take turns on one thread */
+		if (!done && !embed_channel_full_cb(c) && embed_vm(s[0].h) != EMBED_YIELDED) /* ran 'bye' */
+			embed_channel_close(c), done = 1;
+		r1 = embed_vm(s[1].h);
+	}
+	if (check("one thread", s, count) < 0)
+		r = -1;
+
+	embed_channel_free(c);
+	if (!(c = embed_channel_new(CHANNEL_SIZE)))
+		embed_fatal("pipe: allocate failed");
+	memset(s, 0, sizeof s);
+	stages(s, c, count, out, out_max, 1);
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, writer, &s[0]))
+		embed_fatal("pipe: thread creation failed");
+	while (embed_vm(s[1].h) > 0)
+		;
+	pthread_join(thread, NULL);
+	if (check("two threads", s, count) < 0)
+		r = -1;
+
+	embed_channel_free(c);
+	if (!(c = embed_channel_new(CHANNEL_SIZE)))
+		embed_fatal("pipe: allocate failed");
+	memset(s, 0, sizeof s);
+	stages(s, c, count, out, out_max, 1);
+	if (pthread_create(&thread, NULL, writer, &s[0]))
+		embed_fatal("pipe: thread creation failed");
+	char b[16];
+	for (size_t got = 0; got < sizeof b && !embed_channel_eof(c); ) /* read a little, then go away */
+		got += embed_channel_read(c, b + got, sizeof b - got);
+	embed_channel_hangup(c);
+	pthread_join(thread, NULL); /* would wait forever if the writer did */
+	fprintf(stdout, "hang up: writer stopped, ok\n");
+	embed_free(s[0].h);
+	embed_free(s[1].h);
+
+	embed_channel_free(c);
+	free(out);
+	return r < 0 ? 1 : 0;
+}
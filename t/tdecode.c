@@ -0,0 +1,72 @@
+/**@brief Embed library binary trace decoder
+ * @license MIT
+ * @author Richard James Howe
+ * @file tdecode.c
+ *
+ * See <https://github.com/howerj/embed> for more information.
+ *
+ * This program prints out a binary trace, recorded with the 'trace' option
+ * (or the '-B' option of 'embed'), in the same format as a text trace. Names
+ * of words are looked up in an image, which should be the image that was
+ * being run when the trace was made, or one saved from it afterwards, the
+ * default image is used if none is given. An image built without word
+ * headers has its names given by a name table made by the metacompiler
+ * (see 'headerless.blk' in the makefile) instead. Usage:
+ *
+ * 	./tdecode file.trc [image.blk [names.sym]]
+ *
+ * Text traces are slow to make as each instruction is disassembled and
+ * written out as it is run, a binary trace only copies a few numbers into a
+ * ring buffer, so it can be left on and only looked at when something goes
+ * wrong. */
+
+#include "util.h"
+#include "embed.h"
+#include <stdint.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main(int argc, char **argv) {
+	if (argc < 2 || argc > 4) {
+		fprintf(stderr, "usage: %s file.trc [image.blk [names.sym]]\n", argv[0]);
+		return 1;
+	}
+	static embed_symbol_t symbols[2048];
+	embed_symbols_t index = { .symbols = symbols, .max = sizeof (symbols) / sizeof (symbols[0]) };
+	embed_trace_t trace;
+	embed_t *h = embed_new();
+	if (!h)
+		embed_fatal("tdecode: allocate failed");
+	if (argc >= 3) {
+		memset(embed_core_get(h), 0, EMBED_CORE_SIZE * sizeof(cell_t));
+		if (embed_load(h, argv[2]) < 0)
+			embed_fatal("tdecode: load failed (input = %s)", argv[2]);
+	}
+	if (embed_trace_load(&trace, argv[1]) < 0)
+		embed_fatal("tdecode: trace load failed (input = %s)", argv[1]);
+	embed_opt_t o = embed_opt_default(); /* boot with no input, which sets up the search order */
+	embed_opt_set(h, &o);
+	if (embed_vm(h) < 0)
+		embed_warning("tdecode: image failed to boot");
+	embed_opt_get(h)->symbols = &index;
+	if (argc == 4) {
+		const int r = embed_symbols_load(&index, argv[3]);
+		if (r < -1)
+			embed_fatal("tdecode: name table load failed (input = %s)", argv[3]);
+		if (r < 0)
+			embed_warning("tdecode: too many words to name them all");
+	} else if (embed_symbols_update(h, &index) < 0) {
+		embed_warning("tdecode: too many words to name them all");
+	}
+	fprintf(stdout, "( %llu instructions, the last %lu follow )\n", (unsigned long long)trace.count, (unsigned long)trace.length);
+	for (size_t i = 0; i < trace.length; i++) {
+		char line[160] = { 0 };
+		embed_trace_format(h, &trace.records[i], line, sizeof line);
+		fputs(line, stdout);
+	}
+	free(trace.records);
+	free(index.names);
+	embed_free(h);
+	return 0;
+}
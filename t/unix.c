@@ -19,6 +19,13 @@
  * 'no_data' parameter to a non-zero value, indicating to the program running
  * under the virtual machine that there is no data - at this time. If the user
  * has hit a key, it returns the key value and 'no_data' should be set to zero.
+ * Rather than return straight away the callback waits, for up to 'TIMEOUT',
+ * for a key to be hit. The virtual machine only yields when nothing has been typed for
+ * that long, instead of after every key when typing.
+ *
+ * In raw mode output is only flushed when the callback runs out of input, so
+ * that when text is pasted in the characters echoed back are written out
+ * together and not one at a time.
  *
  * This program also tests that the default virtual machine image handles raw
  * mode correctly. Unlike handling a non-blocking input source, the virtual
@@ -27,6 +34,10 @@
  * back to the user by the terminal handling program - instead the eForth image
  * must echo back characters and handle character deletion.
  *
+ * An interval timer preempts the virtual machine every so often, so that
+ * output is flushed even when a program is stuck in a loop that never asks
+ * for input.
+ *
  * See <https://unix.stackexchange.com/questions/21752> for the difference
  * between 'raw' and 'cooked' modes. */
 
@@ -39,13 +50,20 @@
 #include <termios.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/time.h>
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 
 static struct termios old, new;
 static int fd = -1;
+static bool batch = false; /**< only flush output when out of input */
+static volatile sig_atomic_t preempt = 0; /**< set by the interval timer */
 
+#define TIMEOUT (100 * 1000uL) /**< microseconds to wait for input before yielding */
+#define SLICE   (250 * 1000L)  /**< microseconds the virtual machine runs for before it is preempted */
 #define EOT    (4)  /**< ASCII End Of Transmission */
 #define ESCAPE (27) /**< ASCII Escape Character */
 
@@ -86,14 +104,26 @@ static int unix_getch(void *file, int *no_data) {
 	int fd = (int)(intptr_t)file;
 	bool eagain = false;
 	int r = getch(fd, &eagain);
+	if (eagain) {
+		struct pollfd p = { .fd = fd, .events = POLLIN };
+		fflush(stdout);
+		if (poll(&p, 1, TIMEOUT / 1000) > 0)
+			r = getch(fd, &eagain);
+	}
 	*no_data = eagain ? -1 : 0;
 	r = (r == ESCAPE || r == EOT) ? EOF : r;
 	return r;
 }
 
+static void tick(int sig) {
+	UNUSED(sig);
+	preempt = 1;
+}
+
 static int unix_putch(int ch, void *file) {
 	int r = fputc(ch, file);
-	fflush(file);
+	if (!batch)
+		fflush(file);
 	return r;
 }
 
@@ -110,6 +140,7 @@ int main(void) {
 		if (raw(fd) < 0)
 			embed_fatal("failed to set terminal attributes: %s", strerror(errno));
 		atexit(cooked);
+		batch = true;
 	} else {
 		embed_info("NOT A TTY");
 		options |= EMBED_VM_QUITE_ON;
@@ -119,6 +150,13 @@ int main(void) {
 	o.get      = unix_getch,           o.put   = unix_putch, o.save = embed_save_cb,
 	o.in       = (void*)(intptr_t)fd,  o.out   = out,
 	o.options  = options;
+	o.preempt  = &preempt;
+
+	struct sigaction sa = { .sa_handler = tick, .sa_flags = SA_RESTART };
+	sigemptyset(&sa.sa_mask);
+	const struct itimerval slice = { .it_interval = { .tv_usec = SLICE }, .it_value = { .tv_usec = SLICE } };
+	if (sigaction(SIGALRM, &sa, NULL) < 0 || setitimer(ITIMER_REAL, &slice, NULL) < 0)
+		embed_fatal("failed to start timer: %s", strerror(errno));
 
 	embed_t *h = embed_new();
 	if (!h)
@@ -128,10 +166,14 @@ int main(void) {
 	 * '0' on successful exit (with no more work to do) and negative on an
 	 * error (with no more work to do). This is however only by convention,
 	 * another image that is not the default image is free to return
-	 * whatever it likes. Also, we call 'usleep()' here, but we could do
-	 * other work if we wanted to. */
+	 * whatever it likes. 'unix_getch' has already waited for input before
+	 * the image yields, so there is no need to sleep here, but we could do
+	 * other work if we wanted to. 'EMBED_PREEMPTED' is returned when the
+	 * timer has gone off. */
 	for (r = 0; (r = embed_vm(h)) > 0; )
-		usleep(10 * 1000uLL);
+		if (r == EMBED_PREEMPTED)
+			fflush(out);
+	fflush(out);
 	return r;
 }
 
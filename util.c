@@ -7,10 +7,21 @@
 #include <string.h>
 #include <stdarg.h>
 
+/* The log level is read by every thread that logs, so it is atomic when the
+ * compiler has C11 atomics, the makefile compiles this file as C11 */
+#if __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+static atomic_int global_log_level = EMBED_LOG_LEVEL_INFO; /**< Global log level */
+void embed_log_level_set(embed_log_level_e level) { atomic_store_explicit(&global_log_level, level, memory_order_relaxed); }
+embed_log_level_e embed_log_level_get(void) { return atomic_load_explicit(&global_log_level, memory_order_relaxed); }
+#else
 static embed_log_level_e global_log_level = EMBED_LOG_LEVEL_INFO; /**< Global log level */
-
 void embed_log_level_set(embed_log_level_e level) { global_log_level = level; }
 embed_log_level_e embed_log_level_get(void) { return global_log_level; }
+#endif
+static embed_log_sink_t log_sink = NULL; /**< Where log lines go, if not to stderr */
+static void *log_sink_param = NULL;
+void embed_log_sink_set(embed_log_sink_t sink, void *param) { log_sink = sink; log_sink_param = param; }
 void embed_die(void) { exit(EXIT_FAILURE); }
 void *embed_alloc(const size_t sz) { return calloc(sz, 1); }
 
@@ -28,9 +39,21 @@ static void _embed_logger(embed_log_level_e level, const char *file, const char
 		[EMBED_LOG_LEVEL_DEBUG]    =  "debug",
 		[EMBED_LOG_LEVEL_ALL_ON]   =  "all-on",
 	};
-	fprintf(stderr, "(%s:%s:%s:%u)\t", str[level], file, func, line);
-	vfprintf(stderr, fmt, arg);
-	fputc('\n', stderr);
+	if (!log_sink || level == EMBED_LOG_LEVEL_FATAL) { /* fatal errors are never left in a queue */
+		fprintf(stderr, "(%s:%s:%s:%u)\t", str[level], file, func, line);
+		vfprintf(stderr, fmt, arg);
+		fputc('\n', stderr);
+		goto end;
+	}
+	char b[EMBED_LOG_LINE];
+	const int h = snprintf(b, sizeof b, "(%s:%s:%s:%u)\t", str[level], file, func, line);
+	const int m = h < 0 || h >= (int)sizeof b ? 0 : vsnprintf(b + h, sizeof b - h, fmt, arg);
+	size_t l = (h < 0 ? 0 : h) + (m < 0 ? 0 : m);
+	if (l > sizeof b - 2) /* long lines are cut short */
+		l = sizeof b - 2;
+	b[l++] = '\n';
+	b[l] = '\0';
+	log_sink(log_sink_param, level, b, l);
 end:
 	if (level == EMBED_LOG_LEVEL_FATAL)
 		embed_die();
@@ -71,8 +94,8 @@ fail:
 void embed_free(embed_t *h)  {
 	if (!h)
 		return;
-	memset(h, 0, sizeof(*h));
 	free(h->m);
+	memset(h, 0, sizeof(*h));
 	free(h);
 }
 
@@ -90,11 +113,203 @@ int embed_load(embed_t *h, const char *name) {
 	return r;
 }
 
+int embed_symbols_load(embed_symbols_t *s, const char *name) {
+	assert(s && name && (s->symbols || !(s->max)));
+	FILE *f = fopen(name, "rb");
+	if (!f)
+		return -69; /* open-file IOR */
+	int r = -70; /* read-file IOR */
+	long length = 0;
+	char *b = NULL;
+	if (fseek(f, 0, SEEK_END) < 0 || (length = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) < 0)
+		goto fail;
+	if (!(b = embed_alloc(length + 1)) || fread(b, 1, length, f) != (size_t)length)
+		goto fail;
+	b[length] = 0;
+	free(s->names);
+	s->names = b, s->count = 0, r = 0;
+	for (char *line = b, *next = NULL; *line; line = next) {
+		if ((next = strchr(line, '\n')))
+			*next++ = 0;
+		else
+			next = line + strlen(line);
+		if (strncmp(line, "sym ", 4))
+			continue;
+		char *word = NULL;
+		const unsigned long address = strtoul(line + 4, &word, 16);
+		if (word == line + 4 || *word++ != ' ' || !*word)
+			continue;
+		word[strcspn(word, " \r")] = 0;
+		const embed_symbol_t sym = { .start = address >> 1, .name = word };
+		size_t k = s->count;
+		if (k == s->max) { /* full: keep the lowest addresses */
+			r = -1;
+			if (!k || s->symbols[k - 1].start < sym.start)
+				continue;
+			k--;
+		} else {
+			s->count++;
+		}
+		for (; k && s->symbols[k - 1].start > sym.start; k--) /* insertion sort */
+			s->symbols[k] = s->symbols[k - 1];
+		s->symbols[k] = sym;
+	}
+	b = NULL;
+fail:
+	free(b);
+	fclose(f);
+	return r;
+}
+
+/* Trace files are a magic number, the number of records made in total and
+ * the number in the file (both 32-bit little endian), then the records, the
+ * oldest first, with each field a 16-bit little endian number. */
+static const uint8_t embed_trace_magic[8] = { 'E', 'M', 'B', 'E', 'D', 'T', 'R', '\n' };
+#define EMBED_TRACE_FIELDS (5)
+
+static void embed_trace_fields(embed_trace_record_t *r, cell_t **f) {
+	f[0] = &r->pc, f[1] = &r->instruction, f[2] = &r->t, f[3] = &r->rp, f[4] = &r->sp;
+}
+
+int embed_trace_save(const embed_trace_t *t, const char *name) {
+	assert(t && name);
+	const size_t n = t->count < t->length ? t->count : t->length;
+	FILE *f = fopen(name, "wb");
+	if (!f)
+		return -76; /* write-file IOR */
+	uint8_t header[16] = { 0 }; /* 64-bit counts, a trace may run for more than 2^32 instructions */
+	for (size_t i = 0; i < 8; i++) {
+		header[i]     = (t->count >> (i * 8)) & 0xFF;
+		header[i + 8] = ((uint64_t)n >> (i * 8)) & 0xFF;
+	}
+	int r = fwrite(embed_trace_magic, 1, sizeof embed_trace_magic, f) == sizeof embed_trace_magic
+		&& fwrite(header, 1, sizeof header, f) == sizeof header ? 0 : -76;
+	for (size_t i = t->count - n; !r && i < t->count; i++) {
+		embed_trace_record_t record = t->records[i & (t->length - 1)];
+		cell_t *fields[EMBED_TRACE_FIELDS];
+		uint8_t b[EMBED_TRACE_FIELDS * 2];
+		embed_trace_fields(&record, fields);
+		for (size_t j = 0; j < EMBED_TRACE_FIELDS; j++)
+			b[j * 2] = *fields[j] & 0xFF, b[j * 2 + 1] = *fields[j] >> 8;
+		if (fwrite(b, 1, sizeof b, f) != sizeof b)
+			r = -76;
+	}
+	if (fclose(f) < 0)
+		r = -76;
+	return r;
+}
+
+int embed_trace_load(embed_trace_t *t, const char *name) {
+	assert(t && name);
+	memset(t, 0, sizeof *t);
+	FILE *f = fopen(name, "rb");
+	if (!f)
+		return -69; /* open-file IOR */
+	uint8_t magic[sizeof embed_trace_magic] = { 0 }, header[16] = { 0 };
+	int r = -70; /* read-file IOR */
+	if (fread(magic, 1, sizeof magic, f) != sizeof magic || memcmp(magic, embed_trace_magic, sizeof magic))
+		goto fail;
+	if (fread(header, 1, sizeof header, f) != sizeof header)
+		goto fail;
+	uint64_t count = 0, n = 0;
+	for (size_t i = 0; i < 8; i++) {
+		count |= (uint64_t)header[i] << (i * 8);
+		n     |= (uint64_t)header[i + 8] << (i * 8);
+	}
+	if (n > count || n >= SIZE_MAX / sizeof *t->records || !(t->records = embed_alloc((n + 1) * sizeof *t->records)))
+		goto fail;
+	for (size_t i = 0; i < n; i++) {
+		uint8_t b[EMBED_TRACE_FIELDS * 2];
+		cell_t *fields[EMBED_TRACE_FIELDS];
+		if (fread(b, 1, sizeof b, f) != sizeof b)
+			goto fail;
+		embed_trace_fields(&t->records[i], fields);
+		for (size_t j = 0; j < EMBED_TRACE_FIELDS; j++)
+			*fields[j] = b[j * 2] | (b[j * 2 + 1] << 8);
+	}
+	t->length = n, t->count = count;
+	r = 0;
+fail:
+	if (r < 0) {
+		free(t->records);
+		t->records = NULL;
+	}
+	fclose(f);
+	return r;
+}
+
+static int embed_save_compressed(const embed_t *h, const void *name, const size_t start, const size_t length) {
+	assert(h && name);
+	const embed_mmu_read_t  mr = h->o.read;
+	const size_t raw_length = (length - start) * sizeof(cell_t);
+	size_t out_length = raw_length + (raw_length / 255) + 32;
+	uint8_t *raw = embed_alloc(raw_length + 1), *out = embed_alloc(out_length);
+	int r = -76; /* write-file IOR */
+	if (!raw || !out)
+		goto fail;
+	for (size_t i = start; i < length; i++) {
+		raw[(i - start) * 2 + 0] = mr(h, i) & 255;
+		raw[(i - start) * 2 + 1] = mr(h, i) >> 8;
+	}
+	if (embed_compress(out, &out_length, raw, raw_length) < 0)
+		goto fail;
+	FILE *file = fopen(name, "wb");
+	if (!file) {
+		r = -69; /* open-file IOR */
+		goto fail;
+	}
+	r = fwrite(out, 1, out_length, file) == out_length ? 0 : -76;
+	if (fclose(file) < 0)
+		r = -62; /* close-file IOR */
+fail:
+	free(raw);
+	free(out);
+	return r;
+}
+
+static int embed_fput16(cell_t v, FILE *out) {
+	return fputc(v & 255, out) < 0 || fputc(v >> 8, out) < 0 ? -76 /* write-file IOR */ : 0;
+}
+
+/* Zero runs shorter than an extent header are kept inside the extent */
+static int embed_save_sparse(const embed_t *h, const void *name, const size_t start, const size_t length) {
+	assert(h && name);
+	const embed_mmu_read_t  mr = h->o.read;
+	const size_t bytes = (length - start) * sizeof(cell_t);
+	FILE *out = fopen(name, "wb");
+	if (!out)
+		return -69; /* open-file IOR */
+	int r = fwrite("\x89" "ES\x1A", 1, 4, out) == 4 ? 0 : -76;
+	r = r ? r : embed_fput16(bytes & 0xFFFF, out);
+	r = r ? r : embed_fput16(bytes >> 16, out);
+	for (size_t i = start; !r && i < length; ) {
+		size_t end = i, zeros = 0;
+		for (; i < length && !mr(h, i); i++)
+			;
+		for (end = i; end < length && zeros < 2; end++)
+			zeros = mr(h, end) ? 0 : zeros + 1;
+		end -= zeros;
+		if (i == end)
+			break;
+		r = embed_fput16(i - start, out);
+		r = r ? r : embed_fput16(end - i, out);
+		for (; !r && i < end; i++)
+			r = embed_fput16(mr(h, i), out);
+	}
+	r = r ? r : embed_fput16(0, out);
+	r = r ? r : embed_fput16(0, out);
+	return fclose(out) < 0 ? -62 /* close-file IOR */ : r;
+}
+
 int embed_save_cb(const embed_t *h, const void *name, const size_t start, const size_t length) {
 	assert(h);
 	const embed_mmu_read_t  mr = h->o.read;
-	if (!name || !(((length - start) <= length) && ((start + length) <= embed_cells(h))))
+	if (!name || !((start <= length) && (length <= embed_cells(h))))
 		return -69; /* open-file IOR */
+	if (h->o.options & EMBED_VM_COMPRESS)
+		return embed_save_compressed(h, name, start, length);
+	if (h->o.options & EMBED_VM_SPARSE)
+		return embed_save_sparse(h, name, start, length);
 	FILE *out = fopen(name, "wb");
 	if (!out)
 		return -69; /* open-file IOR */
@@ -134,25 +349,16 @@ int embed_fgetc_cb(void *file, int *no_data) {
 	return fgetc(file);
 }
 
-static inline int is_big_endian(void) {
-	return (*(uint16_t *)"\0\xff" < 0x100);
-}
-
-static void embed_normalize(embed_t *h, size_t l)  {
-	assert(h);
-	if (is_big_endian())
-		embed_buffer_swap(h->m, l);
-}
-
 int embed_load_file(embed_t *h, FILE *input) {
 	assert(h && input);
-	const size_t r = fread(h->m, 1, EMBED_CORE_SIZE * sizeof(cell_t), input);
-	embed_normalize(h, r / 2);
-	return r < 128 ? -70 /* read-file IOR */ : 0; /* minimum size checks, 128 bytes */
+	return embed_load_stream(h, embed_fgetc_cb, input);
 }
 
 int embed_forth_opt(embed_t *h, embed_vm_option_e opt, FILE *in, FILE *out, const char *block) {
 	embed_opt_t o_old = embed_opt_default_hosted();
+	o_old.symbols = h->o.symbols;
+	o_old.trace   = h->o.trace;
+	o_old.stats   = h->o.stats;
 	embed_opt_t o_new = o_old;
 	o_new.in = in, o_new.out = out, o_new.options = opt, o_new.name = block;
 	embed_opt_set(h, &o_new);
@@ -375,9 +581,8 @@ static inline int test_embed_callbacks(void) {
 }
 
 static int test_yield(void *param) {
-	(void)param;
-	static unsigned i = 0;
-	return i++ > 1000; //406701;
+	unsigned *i = param;
+	return (*i)++ > 1000; //406701;
 }
 
 static inline int test_embed_yields(void) {
@@ -385,10 +590,194 @@ static inline int test_embed_yields(void) {
 	embed_t *h = NULL;
 	unit_test_verify(&t, (h = embed_new()) != NULL);
 
+	unsigned count = 0;
 	embed_opt_t o = *embed_opt_get(h);
 	unit_test_statement(&t, o.yield = test_yield);
+	unit_test_statement(&t, o.yields = &count);
+	unit_test_statement(&t, embed_opt_set(h, &o));
+	unit_test(&t, embed_vm(h) == EMBED_YIELDED);
+
+	unit_test_statement(&t, embed_free(h));
+	return unit_test_finish(&t);
+}
+
+typedef struct {
+	volatile sig_atomic_t flag;
+	unsigned long ticks;
+} test_timer_t;
+
+static int test_preempt_tick(void *param) { /* stands in for an interval timer */
+	test_timer_t *timer = param;
+	if (++timer->ticks % 10000 == 0)
+		timer->flag = 1;
+	return 0;
+}
+
+static inline int test_embed_preempt(void) {
+	unit_test_t t = unit_test_start();
+	embed_t *h = NULL;
+	unit_test_verify(&t, (h = embed_new()) != NULL);
+
+	test_timer_t timer = { .flag = 0, .ticks = 0 };
+	const char *program = ": spin begin again ; spin\n";
+	embed_opt_t o = *embed_opt_get(h);
+	unit_test_statement(&t, o.get = embed_sgetc_cb);
+	unit_test_statement(&t, o.in = &program);
+	unit_test_statement(&t, o.yield = test_preempt_tick);
+	unit_test_statement(&t, o.yields = &timer);
+	unit_test_statement(&t, o.preempt = &timer.flag);
+	unit_test_statement(&t, embed_opt_set(h, &o));
+	unit_test(&t, embed_vm(h) == EMBED_PREEMPTED);
+	unit_test(&t, timer.flag == 0);
+	unsigned i = 0;
+	for (i = 0; i < 100; i++) /* it never finishes, but it can always be stopped */
+		if (embed_vm(h) != EMBED_PREEMPTED)
+			break;
+	unit_test(&t, i == 100);
+	unit_test(&t, *program == '\0');
+
+	unit_test_statement(&t, embed_free(h));
+	return unit_test_finish(&t);
+}
+
+static inline int test_embed_trace(void) {
+	unit_test_t t = unit_test_start();
+	embed_t *h = NULL;
+	unit_test_verify(&t, (h = embed_new()) != NULL);
+	static const char test_file[] = "test_trace.log";
+	embed_trace_record_t records[64], *last = NULL;
+	embed_trace_t trace = { .records = records, .length = 64, .count = 0 }, loaded = { .records = NULL };
+
+	const char *program = "bye\n";
+	embed_opt_t o = *embed_opt_get(h);
+	unit_test_statement(&t, o.get = embed_sgetc_cb);
+	unit_test_statement(&t, o.in = &program);
+	unit_test_statement(&t, o.trace = &trace);
+	unit_test_statement(&t, o.options = EMBED_VM_TRACE_ON);
+	unit_test_statement(&t, embed_opt_set(h, &o));
+	unit_test(&t, embed_vm(h) == 0);
+	unit_test(&t, trace.count > trace.length);
+	unit_test_statement(&t, last = &records[(trace.count - 1) % trace.length]);
+	unit_test(&t, last->instruction == 0x7B00); /* the 'bye' instruction */
+
+	unit_test(&t, embed_trace_save(&trace, test_file) == 0);
+	unit_test(&t, embed_trace_load(&loaded, test_file) == 0);
+	unit_test(&t, loaded.count == trace.count && loaded.length == trace.length);
+	unit_test(&t, loaded.records && !memcmp(&loaded.records[63], last, sizeof *last));
+	unit_test(&t, loaded.records && !memcmp(&loaded.records[0], &records[trace.count % 64], sizeof *last));
+	unit_test_statement(&t, free(loaded.records));
+	unit_test_statement(&t, trace.count += (uint64_t)1 << 32); /* the ring is unchanged */
+	unit_test(&t, embed_trace_save(&trace, test_file) == 0);
+	unit_test(&t, embed_trace_load(&loaded, test_file) == 0);
+	unit_test(&t, loaded.count == trace.count && loaded.length == trace.length);
+	unit_test(&t, loaded.records && !memcmp(&loaded.records[63], last, sizeof *last));
+	unit_test_statement(&t, remove(test_file));
+
+	unit_test_statement(&t, free(loaded.records));
+	unit_test_statement(&t, embed_free(h));
+	return unit_test_finish(&t);
+}
+
+static inline int test_embed_trace_filter(void) {
+	unit_test_t t = unit_test_start();
+	embed_t *h = NULL;
+	unit_test_verify(&t, (h = embed_new()) != NULL);
+	static embed_trace_record_t records[8192];
+	embed_trace_t all = { .records = records, .length = 8192, .count = 0 };
+	cell_t *fresh = NULL; /* each run starts from the same image */
+	unit_test_verify(&t, (fresh = embed_alloc(EMBED_CORE_SIZE * sizeof(cell_t))) != NULL);
+	unit_test_statement(&t, memcpy(fresh, embed_core_get(h), EMBED_CORE_SIZE * sizeof(cell_t)));
+
+	const char *boot = "bye\n";
+	embed_opt_t o = *embed_opt_get(h);
+	unit_test_statement(&t, o.get = embed_sgetc_cb);
+	unit_test_statement(&t, o.in = &boot);
+	unit_test_statement(&t, o.trace = &all);
+	unit_test_statement(&t, o.options = EMBED_VM_TRACE_ON);
+	unit_test_statement(&t, embed_opt_set(h, &o));
+	unit_test(&t, embed_vm(h) == 0);
+
+	embed_trace_t some = { .records = records, .length = 8192, .count = 0 };
+	unit_test_statement(&t, boot = "bye\n");
+	unit_test_statement(&t, o.trace = &some);
+	unit_test_statement(&t, o.filter.classes = EMBED_TRACE_CALL);
+	unit_test_statement(&t, embed_opt_set(h, &o));
+	unit_test_statement(&t, memcpy(embed_core_get(h), fresh, EMBED_CORE_SIZE * sizeof(cell_t)));
+	unit_test(&t, embed_vm(h) == 0);
+	unit_test(&t, some.count > 0 && some.count < all.count);
+	size_t calls = 0, kept = some.count < some.length ? some.count : some.length;
+	for (size_t i = 0; i < kept; i++)
+		calls += (records[i].instruction & 0xE000) == 0x4000;
+	unit_test(&t, calls == kept);
+
+	unit_test_statement(&t, some.count = 0);
+	unit_test_statement(&t, boot = "bye\n");
+	unit_test_statement(&t, o.filter.classes = 0);
+	unit_test_statement(&t, o.filter.every = 10);
+	unit_test_statement(&t, embed_opt_set(h, &o));
+	unit_test_statement(&t, memcpy(embed_core_get(h), fresh, EMBED_CORE_SIZE * sizeof(cell_t)));
+	unit_test(&t, embed_vm(h) == 0);
+	unit_test(&t, some.count == all.count / 10);
+
+	unit_test_statement(&t, some.count = 0);
+	unit_test_statement(&t, boot = "bye\n");
+	unit_test_statement(&t, o.filter.every = 0);
+	unit_test_statement(&t, o.filter.start = 0x100);
+	unit_test_statement(&t, o.filter.end = 0x200);
+	unit_test_statement(&t, embed_opt_set(h, &o));
+	unit_test_statement(&t, memcpy(embed_core_get(h), fresh, EMBED_CORE_SIZE * sizeof(cell_t)));
+	unit_test(&t, embed_vm(h) == 0);
+	unit_test(&t, some.count > 0 && some.count < all.count);
+	unit_test(&t, records[0].pc >= 0x100 && records[0].pc < 0x200);
+
+	const char *program = ": filter! [ $7E03 , ] ; 4 3 filter! bye\n"; /* the image can set it too */
+	unit_test_statement(&t, o.in = &program);
+	unit_test_statement(&t, o.options = 0);
 	unit_test_statement(&t, embed_opt_set(h, &o));
 	unit_test(&t, embed_vm(h) == 0);
+	unit_test(&t, embed_opt_get(h)->filter.every == 4);
+
+	unit_test_statement(&t, free(fresh));
+	unit_test_statement(&t, embed_free(h));
+	return unit_test_finish(&t);
+}
+
+static inline int test_embed_stats(void) {
+	unit_test_t t = unit_test_start();
+	embed_t *h = NULL;
+	unit_test_verify(&t, (h = embed_new()) != NULL);
+	embed_stats_t stats = { .count = { 0 } }, out = { .count = { 0 } };
+	unit_test(&t, embed_stats(h, &out) < 0);
+
+	const char *program = "2 2 + . bye\n";
+	embed_opt_t o = *embed_opt_get(h);
+	unit_test_statement(&t, o.get = embed_sgetc_cb);
+	unit_test_statement(&t, o.in = &program);
+	unit_test_statement(&t, o.stats = &stats);
+	unit_test_statement(&t, embed_opt_set(h, &o));
+	unit_test(&t, embed_vm(h) == 0);
+	unit_test(&t, embed_stats(h, &out) == 0);
+	unit_test(&t, out.count[EMBED_STAT_LITERAL] > 0);
+	unit_test(&t, out.count[EMBED_STAT_CALL] > 0);
+	unit_test(&t, out.count[EMBED_STAT_0BRANCH_TAKEN] > 0);
+	unit_test(&t, out.count[EMBED_STAT_0BRANCH_TAKEN] < out.count[EMBED_STAT_0BRANCH]);
+	unsigned long ops = 0;
+	for (size_t i = 0; i < 32; i++)
+		ops += out.count[EMBED_STAT_ALU_OP + i];
+	unit_test(&t, ops == out.count[EMBED_STAT_ALU]);
+	unit_test(&t, out.count[EMBED_STAT_BYTES_IN] == strlen("2 2 + . bye\n"));
+	unit_test(&t, out.count[EMBED_STAT_BYTES_OUT] > 0);
+	unit_test(&t, out.count[EMBED_STAT_PUT] == out.count[EMBED_STAT_ALU_OP + 23]);
+	unit_test(&t, out.count[EMBED_STAT_YIELD] == 1);
+
+	const char *read = ": stat [ $7F81 , ] ; 42 stat $4000 ! $4002 ! 99 stat $4004 ! $4006 ! bye\n";
+	unit_test_statement(&t, memset(&stats, 0, sizeof stats));
+	unit_test_statement(&t, stats.count[EMBED_STAT_YIELD] = 0x20003);
+	unit_test_statement(&t, o.in = &read);
+	unit_test_statement(&t, embed_opt_set(h, &o));
+	unit_test(&t, embed_vm(h) == 0);
+	unit_test(&t, embed_core_get(h)[0x2000] == 2 && embed_core_get(h)[0x2001] == 3);
+	unit_test(&t, embed_core_get(h)[0x2002] == 0 && embed_core_get(h)[0x2003] == 0); /* out of range */
 
 	unit_test_statement(&t, embed_free(h));
 	return unit_test_finish(&t);
@@ -421,6 +810,319 @@ static inline int test_embed_file(void) {
 	return unit_test_finish(&t);
 }
 
+static inline int test_embed_compress(void) {
+	unit_test_t t = unit_test_start();
+	embed_t *h = NULL;
+	uint8_t *raw = NULL, *z = NULL;
+	unit_test_verify(&t, (h = embed_new()) != NULL);
+	const size_t length = embed_length(h);
+	size_t zl = length * 2;
+	unit_test_verify(&t, (raw = embed_alloc(length)) != NULL);
+	unit_test_verify(&t, (z = embed_alloc(zl)) != NULL);
+	for (size_t i = 0; i < length / 2; i++) {
+		raw[i * 2 + 0] = embed_core_get(h)[i] & 255;
+		raw[i * 2 + 1] = embed_core_get(h)[i] >> 8;
+	}
+
+	unit_test(&t, embed_compress(z, &zl, raw, length) == 0);
+	unit_test(&t, zl < length);
+	unit_test_statement(&t, memset(embed_core_get(h), 0, length));
+	unit_test(&t, embed_load_buffer(h, z, zl) == 0);
+	unit_test(&t, embed_load_buffer(h, z, zl - 1) != 0);
+	unit_test(&t, embed_eval(h, "2 2 + \n") == 0);
+	cell_t v = 0;
+	unit_test(&t, embed_pop(h, &v) == 0);
+	unit_test(&t, v == 4);
+	size_t small = 8;
+	unit_test(&t, embed_compress(z, &small, raw, length) != 0);
+
+	unit_test_statement(&t, free(raw));
+	unit_test_statement(&t, free(z));
+	unit_test_statement(&t, embed_free(h));
+	return unit_test_finish(&t);
+}
+
+static inline int test_embed_sparse(void) {
+	unit_test_t t = unit_test_start();
+	embed_t *h = NULL, *g = NULL;
+	FILE *f = NULL;
+	static const char test_file[] = "test_sparse.log";
+	unit_test_verify(&t, (h = embed_new()) != NULL);
+	unit_test_verify(&t, (g = embed_new()) != NULL);
+
+	embed_opt_t o = *embed_opt_get(h);
+	unit_test_statement(&t, o.options |= EMBED_VM_SPARSE);
+	unit_test_statement(&t, embed_opt_set(h, &o));
+	unit_test_statement(&t, embed_core_get(h)[embed_cells(h) - 1] = 0xA5A5);
+	unit_test(&t, embed_save(h, test_file) == 0);
+	unit_test_verify(&t, (f = fopen(test_file, "rb")) != NULL);
+	unit_test(&t, fseek(f, 0L, SEEK_END) == 0);
+	unit_test(&t, (size_t)ftell(f) < embed_length(h));
+	unit_test(&t, fclose(f) == 0);
+	unit_test_statement(&t, memset(embed_core_get(g), 0xFF, embed_length(g)));
+	unit_test(&t, embed_load(g, test_file) == 0);
+	unit_test(&t, !memcmp(embed_core_get(g), embed_core_get(h), embed_length(h)));
+	unit_test(&t, remove(test_file) == 0);
+
+	unit_test_statement(&t, embed_free(g));
+	unit_test_statement(&t, embed_free(h));
+	return unit_test_finish(&t);
+}
+
+static inline int test_embed_patch(void) {
+	unit_test_t t = unit_test_start();
+	embed_t *h = NULL, *g = NULL, *k = NULL;
+	uint8_t patch[1024] = { 0 };
+	size_t length = sizeof patch;
+	static const cell_t crc = 0x10, data = 0x3000; /* header CRC and a user data cell */
+	unit_test_verify(&t, (h = embed_new()) != NULL);
+	unit_test_verify(&t, (g = embed_new()) != NULL);
+	unit_test_verify(&t, (k = embed_new()) != NULL);
+
+	unit_test_statement(&t, embed_core_get(g)[crc] ^= 0x0001);
+	unit_test_statement(&t, embed_core_get(g)[data] = 0xCAFE);
+	unit_test(&t, embed_diff(h, g, patch, &length) == 0);
+	unit_test(&t, length < 512);
+	unit_test(&t, embed_eval(k, ": x 2 ; x\n") == 0);
+	cell_t registers[4] = { 0 }, v = 0;
+	unit_test_statement(&t, memcpy(registers, embed_core_get(k), sizeof registers));
+	unit_test(&t, embed_patch(k, patch, length) == 0);
+	unit_test(&t, embed_core_get(k)[data] == 0xCAFE);
+	unit_test(&t, embed_core_get(k)[crc] == 0); /* still live */
+	unit_test(&t, embed_patch(k, patch, length) == 0);
+	unit_test(&t, !memcmp(registers, embed_core_get(k), sizeof registers));
+	unit_test(&t, embed_eval(k, "2 3 + \n") == 0);
+	unit_test(&t, embed_pop(k, &v) == 0);
+	unit_test(&t, v == 5);
+
+	unit_test_statement(&t, embed_core_get(g)[crc] ^= 0x0001); /* a valid target for a loaded image */
+	unit_test_statement(&t, length = sizeof patch);
+	unit_test(&t, embed_diff(h, g, patch, &length) == 0);
+	unit_test_statement(&t, patch[12] ^= 0x01); /* wrong target CRC */
+	unit_test(&t, embed_patch(h, patch, length) == -3);
+	unit_test(&t, embed_core_get(h)[data] == 0);
+	unit_test_statement(&t, patch[12] ^= 0x01);
+	unit_test_statement(&t, patch[length - 3] ^= 0x80);
+	unit_test(&t, embed_patch(h, patch, length) == -3);
+	unit_test(&t, embed_core_get(h)[data] == 0);
+	unit_test_statement(&t, patch[length - 3] ^= 0x80);
+	unit_test(&t, embed_patch(h, patch, length) == 0);
+	unit_test(&t, embed_core_get(h)[data] == 0xCAFE);
+
+	unit_test_statement(&t, embed_free(k));
+	unit_test_statement(&t, embed_free(g));
+	unit_test_statement(&t, embed_free(h));
+	return unit_test_finish(&t);
+}
+
+static inline int test_embed_unchecked(void) {
+	unit_test_t t = unit_test_start();
+	embed_t *h = NULL;
+	cell_t v = 0;
+	unit_test_verify(&t, (h = embed_new()) != NULL);
+
+	embed_opt_t o = *embed_opt_get(h);
+	unit_test_statement(&t, o.options |= EMBED_VM_UNCHECKED);
+	unit_test_statement(&t, embed_opt_set(h, &o));
+	unit_test(&t, embed_eval(h, "2 3 + \n") == 0);
+	unit_test(&t, embed_pop(h, &v) == 0);
+	unit_test(&t, v == 5);
+	unit_test(&t, embed_eval(h, "7 8 * \n") == 0);
+	unit_test(&t, embed_pop(h, &v) == 0);
+	unit_test(&t, v == 56);
+	unit_test(&t, embed_opt_get(h)->options & EMBED_VM_UNCHECKED);
+
+	/* push a literal at the top of the core, then store with an empty stack,
+	 * both make addresses past the ends of the core and must wrap around */
+	cell_t *m = embed_core_get(h);
+	for (int unchecked = 0; unchecked < 2; unchecked++) {
+		unit_test_statement(&t, memset(m, 0, EMBED_CORE_SIZE * sizeof(cell_t)));
+		unit_test_statement(&t, m[5] = 0x8000);
+		unit_test_statement(&t, m[0x100] = 0x8001);  /* literal 1 */
+		unit_test_statement(&t, m[0x101] = 0x6403);  /* ! */
+		unit_test_statement(&t, m[0x102] = 0x7B00);  /* bye */
+		unit_test_statement(&t, (m[0] = 0x100, m[2] = 0x200, m[3] = 0x7FFF, m[0x200] = 1));
+		unit_test_statement(&t, o.options = unchecked ? EMBED_VM_UNCHECKED : 0);
+		unit_test_statement(&t, embed_opt_set(h, &o));
+		unit_test(&t, embed_vm(h) >= -1);
+		unit_test_statement(&t, (m[0] = 0x101, m[1] = 0, m[2] = 0x200, m[3] = 0, m[0x200] = 1));
+		unit_test(&t, embed_vm(h) >= -1);
+	}
+
+	unit_test_statement(&t, embed_free(h));
+	return unit_test_finish(&t);
+}
+
+static inline int test_embed_symbolize(void) {
+	unit_test_t t = unit_test_start();
+	embed_t *h = NULL;
+	cell_t xt = 0, here = 0;
+	char name[32] = { 0 };
+	embed_symbol_t symbols[512];
+	embed_symbols_t s = { .symbols = symbols, .max = sizeof (symbols) / sizeof (symbols[0]) };
+	unit_test_verify(&t, (h = embed_new()) != NULL);
+
+	unit_test(&t, embed_symbolize(h, 0x100, name, sizeof name) < 0); /* no index */
+	unit_test_statement(&t, h->o.symbols = &s);
+	unit_test(&t, embed_eval(h, ": sym-test 1 2 + ; ' sym-test\n") == 0);
+	unit_test(&t, embed_pop(h, &xt) == 0);
+	unit_test(&t, embed_symbolize(h, xt / 2, name, sizeof name) == 0);
+	unit_test(&t, !strcmp(name, "sym-test"));
+	unit_test(&t, embed_symbolize(h, (xt / 2) + 1, name, sizeof name) == 1);
+	unit_test(&t, embed_symbolize(h, (xt / 2) + 1, name, 4) == 1);
+	unit_test(&t, !strcmp(name, "sym"));
+	unit_test(&t, embed_symbols_update(h, &s) == 0); /* already up to date */
+	unit_test(&t, embed_eval(h, ": sym-new ; ' sym-new ' dup\n") == 0);
+	unit_test(&t, embed_pop(h, &xt) == 0);
+	unit_test(&t, embed_symbolize(h, xt / 2, name, sizeof name) == 0);
+	unit_test(&t, !strcmp(name, "dup"));
+	unit_test(&t, embed_pop(h, &xt) == 0);
+	unit_test(&t, embed_symbolize(h, xt / 2, name, sizeof name) == 0);
+	unit_test(&t, !strcmp(name, "sym-new"));
+	unit_test(&t, embed_eval(h, "here\n") == 0);
+	unit_test(&t, embed_pop(h, &here) == 0);
+	unit_test(&t, embed_symbolize(h, here / 2, name, sizeof name) > 0);
+	unit_test(&t, !strcmp(name, "sym-new"));
+	unit_test(&t, embed_symbolize(h, 0, name, sizeof name) < 0);
+
+	embed_symbols_t small = { .symbols = symbols, .max = 8 };
+	unit_test(&t, embed_symbols_update(h, &small) < 0);
+	unit_test(&t, small.count == 8);
+	embed_symbols_t given = { .symbols = symbols, .max = 8, .context = EMBED_SYMBOL_CONTEXT };
+	unit_test(&t, embed_symbols_update(h, &given) < 0);
+	unit_test(&t, given.count == 8);
+	cell_t empty = 0;
+	unit_test(&t, embed_eval(h, "create sym-empty 0 , sym-empty\n") == 0);
+	unit_test(&t, embed_pop(h, &empty) == 0);
+	embed_symbols_t moved = { .symbols = symbols, .max = 8, .context = empty };
+	unit_test(&t, embed_symbols_update(h, &moved) == 1);
+	unit_test(&t, moved.count == 0); /* nothing in that search order */
+
+	FILE *table = NULL;
+	static const char table_file[] = "test_names.log";
+	unit_test_verify(&t, (table = fopen(table_file, "wb")) != NULL);
+	unit_test(&t, fputs("FORTH META COMPILATION START\nsym 4D6 cold\nsym 28 <cold>\n", table) >= 0);
+	unit_test_statement(&t, fclose(table));
+	embed_symbols_t named = { .symbols = symbols, .max = 8 };
+	unit_test(&t, embed_symbols_load(&named, table_file) == 0);
+	unit_test(&t, named.count == 2);
+	unit_test_statement(&t, embed_opt_get(h)->symbols = &named);
+	unit_test(&t, embed_symbolize(h, 0x26C, name, sizeof name) == 1);
+	unit_test(&t, !strcmp(name, "cold"));
+	unit_test(&t, embed_symbolize(h, 0x14, name, sizeof name) == 0);
+	unit_test(&t, !strcmp(name, "<cold>"));
+	unit_test(&t, named.count == 2); /* not rebuilt from the image */
+	unit_test_statement(&t, free(named.names));
+	unit_test_statement(&t, remove(table_file));
+
+	unit_test_statement(&t, embed_free(h));
+	return unit_test_finish(&t);
+}
+
+static inline int test_embed_eval_cached(void) {
+	unit_test_t t = unit_test_start();
+	embed_t *h = NULL;
+	cell_t v = 0;
+	embed_snippet_t snippets[4];
+	embed_snippets_t c = { .snippets = snippets, .max = 2, .size = 256 };
+	unit_test_statement(&t, memset(snippets, 0, sizeof snippets));
+	unit_test_verify(&t, (h = embed_new()) != NULL);
+
+	unit_test(&t, embed_eval_cached(h, &c, "2 3 +") == 0);
+	unit_test(&t, embed_pop(h, &v) == 0 && v == 5);
+	unit_test(&t, c.misses == 1 && c.hits == 0 && c.end > c.start);
+	unit_test(&t, embed_eval_cached(h, &c, "2 3 +") == 0);
+	unit_test(&t, embed_pop(h, &v) == 0 && v == 5);
+	unit_test(&t, c.hits == 1);
+	unit_test(&t, embed_eval(h, "7 \n") == 0);
+	unit_test(&t, embed_eval_cached(h, &c, "if 8 else 9 then") == 0); /* uses the stack */
+	unit_test(&t, embed_pop(h, &v) == 0 && v == 8);
+	unit_test(&t, embed_eval_cached(h, &c, "2 3 +") == 0);
+	unit_test(&t, embed_pop(h, &v) == 0 && v == 5);
+	unit_test(&t, c.hits == 2);
+	unit_test(&t, embed_eval_cached(h, &c, "4 dup *") == 0); /* evicts the 'if' */
+	unit_test(&t, embed_pop(h, &v) == 0 && v == 16);
+	unit_test(&t, embed_eval_cached(h, &c, "2 3 +") == 0);
+	unit_test(&t, embed_pop(h, &v) == 0 && v == 5);
+	unit_test(&t, c.hits == 3 && c.misses == 3);
+	unit_test(&t, embed_eval_cached(h, &c, "0 if 8 else 9 then") == 0);
+	unit_test(&t, embed_pop(h, &v) == 0 && v == 9);
+	unit_test(&t, c.misses == 4);
+	unit_test(&t, embed_eval_cached(h, &c, "no-such-word") < 0);
+	unit_test(&t, embed_eval(h, ": cached-def 1 \n") == 0);
+	unit_test(&t, embed_eval_cached(h, &c, "2 3 +") == 0); /* compiling, so evaluated */
+	unit_test(&t, embed_eval(h, " ; cached-def\n") == 0);
+	unit_test(&t, embed_pop(h, &v) == 0 && v == 5);
+	unit_test(&t, embed_pop(h, &v) == 0 && v == 1);
+	unit_test(&t, embed_depth(h) == 0);
+
+	embed_snippets_t small = { .snippets = snippets, .max = 4, .size = 24 };
+	unit_test_statement(&t, memset(snippets, 0, sizeof snippets));
+	unit_test(&t, embed_eval_cached(h, &small, "2 3 +") == 0);
+	unit_test(&t, embed_eval_cached(h, &small, "4 dup *") == 0); /* no room, evicts '2 3 +' */
+	unit_test(&t, embed_eval_cached(h, &small, "2 3 +") == 0);
+	unit_test(&t, small.misses == 3 && small.hits == 0);
+	unit_test(&t, embed_eval_cached(h, &small, "1 2 3 4 5 6 7 8 9 10 11 12") == 0); /* too big */
+	unit_test(&t, embed_depth(h) == 15);
+	unit_test_statement(&t, embed_free(h));
+
+	/* 'big' compiles more code than its name is long, too much for the area */
+	embed_snippets_t guard = { .snippets = snippets, .max = 4, .size = 16 };
+	unit_test_statement(&t, memset(snippets, 0, sizeof snippets));
+	unit_test_verify(&t, (h = embed_new()) != NULL);
+	unit_test(&t, embed_eval_cached(h, &guard, "0 drop") == 0); /* reserves the area */
+	unit_test(&t, embed_eval(h, ": after 42 ; : big 5 for $8000 , next ; immediate\n") == 0);
+	unit_test(&t, embed_eval_cached(h, &guard, "big") == 0);
+	unit_test(&t, guard.misses == 2 && embed_depth(h) == 0); /* evaluated, not compiled */
+	unit_test(&t, embed_eval(h, "after 1 2 +\n") == 0);
+	unit_test(&t, embed_pop(h, &v) == 0 && v == 3);
+	unit_test(&t, embed_pop(h, &v) == 0 && v == 42);
+	unit_test(&t, embed_eval(h, ": room 8 ;\n") == 0);
+	embed_snippets_t roomy = { .snippets = snippets, .max = 4, .size = 64 };
+	unit_test_statement(&t, memset(snippets, 0, sizeof snippets));
+	unit_test(&t, embed_eval_cached(h, &roomy, "big room") == 0);
+	unit_test(&t, embed_eval_cached(h, &roomy, "big room") == 0);
+	unit_test(&t, roomy.hits == 1 && embed_depth(h) == 14);
+	unit_test(&t, embed_eval(h, ": room 9 ;\n") == 0); /* cached code keeps the old 'room' */
+	unit_test(&t, embed_eval_cached(h, &roomy, "big room") == 0);
+	unit_test(&t, embed_pop(h, &v) == 0 && v == 8);
+	unit_test(&t, embed_eval(h, "room\n") == 0);
+	unit_test(&t, embed_pop(h, &v) == 0 && v == 9);
+
+	unit_test_statement(&t, embed_free(h));
+	return unit_test_finish(&t);
+}
+
+static int test_no_data_given = -1;
+
+static int test_no_data_getc(void *string_ptr, int *no_data) { /* never sets 'no_data' */
+	assert(string_ptr && no_data);
+	char **s = string_ptr;
+	test_no_data_given = *no_data;
+	return **s ? *(*s)++ : EOF;
+}
+
+static inline int test_embed_no_data(void) {
+	unit_test_t t = unit_test_start();
+	embed_t *h = NULL;
+	unit_test_verify(&t, (h = embed_new()) != NULL);
+
+	const char *program = "2 3 * bye\n", *s = program;
+	embed_opt_t o = *embed_opt_get(h);
+	unit_test_statement(&t, o.get = test_no_data_getc);
+	unit_test_statement(&t, o.in = &s);
+	unit_test_statement(&t, o.options = EMBED_VM_QUITE_ON);
+	unit_test_statement(&t, embed_opt_set(h, &o));
+	unit_test(&t, embed_vm(h) == 0);
+	unit_test(&t, test_no_data_given == 0);
+	cell_t v = 0;
+	unit_test(&t, embed_pop(h, &v) == 0);
+	unit_test(&t, v == 6);
+
+	unit_test_statement(&t, embed_free(h));
+	return unit_test_finish(&t);
+}
+
 int embed_tests(void) {
 #ifdef NDEBUG
 	embed_warning("NDEBUG Defined - unit tests not compiled into program");
@@ -430,6 +1132,10 @@ int embed_tests(void) {
 	test_func funcs[] = {
 		test_embed_stack,     test_embed_reset,  test_embed_eval,
 		test_embed_callbacks, test_embed_yields, test_embed_file,
+		test_embed_compress,  test_embed_sparse, test_embed_patch,
+		test_embed_unchecked, test_embed_symbolize, test_embed_eval_cached,
+		test_embed_no_data,   test_embed_preempt, test_embed_trace,
+		test_embed_trace_filter, test_embed_stats,
 	};
 
 	int r = 0;
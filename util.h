@@ -48,6 +48,24 @@ void embed_log_level_set(embed_log_level_e level);
 *  @return Global log level */
 embed_log_level_e embed_log_level_get(void);
 
+#define EMBED_LOG_LINE (256) /**< Longest line, in bytes, passed to a log sink */
+
+/**@brief Function pointer typedef for a log sink, which is given each log
+ * line once it has been formatted instead of it being printed to stderr.
+ * @param param, parameter given to 'embed_log_sink_set'
+ * @param level, level the line was logged at
+ * @param line, ASCII NUL terminated line, ending in a new line
+ * @param length, length of 'line' not including the NUL */
+typedef void (*embed_log_sink_t)(void *param, embed_log_level_e level, const char *line, size_t length);
+
+/**@brief Send log lines to a sink instead of stderr, lines are formatted by
+ * the thread logging them and are cut short at 'EMBED_LOG_LINE' bytes. Fatal
+ * errors are always printed straight to stderr. This should be set before
+ * any other threads are logging.
+ * @param sink, function to give each line to, NULL for stderr
+ * @param param, passed to 'sink' */
+void embed_log_sink_set(embed_log_sink_t sink, void *param);
+
 /**@brief Exit system with failure */
 void embed_die(void);
 
@@ -61,7 +79,8 @@ void embed_die(void);
  * of note, EMBED_LOG_LEVEL_FATAL causes the process to terminate! Even if the
  * log is not printed because the log level is off, 'exit()' will still be
  * called if the log level is fatal. 'exit' is called with the 'EXIT_FAILURE'
- * value.
+ * value. The log level may be changed whilst other threads are logging, the
+ * line goes to stderr or to the sink set with 'embed_log_sink_set()'.
  * @param file,  file logging occurs within, should be __FILE__
  * @param func,  function logging occurs within, should be __func__
  * @param line,  line logging occurred on, should be __LINE__
@@ -149,6 +168,33 @@ embed_opt_t embed_opt_default_hosted(void);
  * @return zero on success, negative on failure */
 int embed_load_file(embed_t *h, FILE *input);
 
+/**@brief Load a name table into an index from code addresses to words, for
+ * naming the code of an image built without word headers. The metacompiler
+ * prints the table when 'name-table' is set, a line per word of the form
+ * 'sym <address> <name>', the address being in hexadecimal and in bytes,
+ * other lines are ignored. Free the 'names' field with 'free' when done.
+ * @param s, index to load into, which is never rebuilt from the image
+ * @param name, name of file to read from
+ * @return zero on success, negative on failure, or if 's' was too small to
+ * hold all of the words, in which case it holds those with the lowest addresses */
+int embed_symbols_load(embed_symbols_t *s, const char *name);
+
+/**@brief Save the records held in a binary trace to a file, the oldest
+ * first, so that they can be looked at later
+ * @param t, trace to save
+ * @param name, name of file to write to
+ * @return zero on success, negative on failure */
+int embed_trace_save(const embed_trace_t *t, const char *name);
+
+/**@brief Load a trace saved with 'embed_trace_save', the records are in
+ * order from the first, the oldest, and 'count' is the number of records
+ * made in total, which may be more than 'length'. Free the 'records' field
+ * with 'free' when done.
+ * @param t, trace to load into
+ * @param name, name of file to read from
+ * @return zero on success, negative on failure */
+int embed_trace_load(embed_trace_t *t, const char *name);
+
 /**@brief Save VM image to disk, 0 == success
  * @param h,     Virtual Machine image to save to disk
  * @param name,  name of file to load